@@ -0,0 +1,33 @@
+#!/bin/sh
+# Allocation check for the command loop (--alloc-warmup).
+# Fills a bounded working set (KEYS keys x 16 values), replays the same random
+# insert/delete/find mix over it twice, and counts operator new / posting-pool mallocs
+# during the second replay. With every bucket cached and every posting list already at
+# its largest size, the second replay must not allocate at all.
+#
+# usage: bench/alloc_check.sh [N]     (default: 100000 ops per pass)
+#        BIN=/path/to/code KEYS=5000 bench/alloc_check.sh
+set -e
+BIN=${BIN:-$(pwd)/code}
+KEYS=${KEYS:-1000}
+n=${1:-100000}
+
+dir=$(mktemp -d)
+awk -v n="$n" -v keys="$KEYS" 'BEGIN {
+    srand(1); print keys * 16 + 2 * n
+    for (k = 0; k < keys; k++) for (v = 0; v < 16; v++) printf "insert key%d %d\n", k, v
+    for (i = 0; i < n; i++) {
+        r = rand(); k = int(rand() * keys); v = int(rand() * 16)
+        if (r < 0.6) line[i] = sprintf("insert key%d %d", k, v)
+        else if (r < 0.8) line[i] = sprintf("delete key%d %d", k, v)
+        else line[i] = sprintf("find key%d", k)
+    }
+    for (pass = 0; pass < 2; pass++) for (i = 0; i < n; i++) print line[i]
+}' > "$dir/ops.txt"
+out=$(cd "$dir" && "$BIN" --alloc-warmup $((KEYS * 16 + n)) < ops.txt 2>&1 > /dev/null)
+rm -rf "$dir"
+echo "$out"
+case "$out" in
+    *"allocs: 0 "*) ;;
+    *) echo "FAIL: warm replay allocated" >&2; exit 1 ;;
+esac
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Lookup latency of the two bucket indexes: the default hash map ($BIN) against the
+# adaptive radix tree build (-DFILESTORE_ART), compiled here from main.cpp so the
+# checked-in ./code is left alone. Each binary builds the same dataset of N entries
+# (keys share a long common prefix, where the tree's path compression pays off), then
+# replays N/2 random finds with --latency; the find row is reported per index.
+#
+# usage: bench/art_lookup.sh [N ...]      (default: 100000 1000000)
+#        BIN=/path/to/code CXX=clang++ PREFIX=user/profile/ bench/art_lookup.sh 200000
+set -e
+BIN=${BIN:-$(pwd)/code}
+PREFIX=${PREFIX:-tenant/session/}
+[ $# -gt 0 ] || set -- 100000 1000000
+
+art=$(mktemp -d)
+${CXX:-c++} -std=c++17 -O3 -DNDEBUG -DFILESTORE_ART main.cpp -o "$art/code-art" -pthread
+
+printf '%10s %6s %10s %9s %9s %9s %9s\n' entries index "finds" "mean us" "p50" "p99" "p99.9"
+for n in "$@"; do
+    dir=$(mktemp -d)
+    awk -v n="$n" -v p="$PREFIX" 'BEGIN {
+        srand(1); print n
+        for (i = 0; i < n; i++) printf "insert %s%d %d\n", p, int(rand() * n / 4), i
+    }' > "$dir/build.txt"
+    awk -v n="$n" -v p="$PREFIX" 'BEGIN {
+        srand(2); q = int(n / 2) + 1; print q
+        for (i = 0; i < q; i++) printf "find %s%d\n", p, int(rand() * n / 4)
+    }' > "$dir/find.txt"
+    for index in hash art; do
+        if [ "$index" = hash ]; then exe=$BIN; else exe=$art/code-art; fi
+        rm -rf "$dir/data"
+        (cd "$dir" && "$exe" < build.txt > /dev/null)
+        (cd "$dir" && "$exe" --latency < find.txt 2>&1 > /dev/null) |
+            awk -v n="$n" -v idx="$index" '$1 == "find" {
+                printf "%10d %6s %10d %9s %9s %9s %9s\n", n, idx, $2, $3, $4, $6, $7
+            }'
+    done
+    rm -rf "$dir"
+done
+rm -rf "$art"
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Response size and pipe throughput per --encode format.
+# Builds KEYS keys of N values each, then replays 2000 finds over them with the
+# responses piped into a reader (optionally through filestore-decode, DECODE=1), and
+# reports the bytes crossing the pipe and the wall time per format.
+#
+# usage: bench/encode_pipe.sh [N]     (default: 20000 values per key)
+#        BIN=/path/to/code KEYS=20 DECODE=1 bench/encode_pipe.sh 100000
+set -e
+BIN=${BIN:-$(pwd)/code}
+DEC=${DEC:-$(dirname "$BIN")/filestore-decode}
+KEYS=${KEYS:-10}
+n=${1:-20000}
+
+dir=$(mktemp -d)
+awk -v n="$n" -v keys="$KEYS" 'BEGIN {
+    srand(1); print n * keys
+    for (k = 0; k < keys; k++) for (i = 0; i < n; i++) printf "insert key%d %d\n", k, i * 7 + int(rand() * 7)
+}' > "$dir/build.txt"
+awk -v keys="$KEYS" 'BEGIN {
+    srand(2); print 2000
+    for (i = 0; i < 2000; i++) printf "find key%d\n", int(rand() * keys)
+}' > "$dir/find.txt"
+(cd "$dir" && "$BIN" < build.txt > /dev/null)
+
+printf '%8s %14s %10s\n' encode bytes seconds
+for enc in text delta lz; do
+    start=$(date +%s.%N)
+    if [ -n "$DECODE" ]; then
+        bytes=$(cd "$dir" && "$BIN" --encode "$enc" < find.txt | "$DEC" | wc -c)
+    else
+        bytes=$(cd "$dir" && "$BIN" --encode "$enc" < find.txt | wc -c)
+    fi
+    end=$(date +%s.%N)
+    awk -v e="$enc" -v b="$bytes" -v t0="$start" -v t1="$end" 'BEGIN { printf "%8s %14d %10.3f\n", e, b, t1 - t0 }'
+done
+rm -rf "$dir"
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Update latency on one extremely hot key.
+# Gives a single key N values (appended in order, which is cheap even unsharded), then
+# replays N/10 random inserts and deletes over its value range with --latency. With
+# value-range shards each update moves at most SHARD_SPLIT values, so the insert and
+# delete rows should stay flat as N grows; set BASE to an older binary to compare.
+#
+# usage: bench/hot_key.sh [N ...]     (default: 100000 1000000)
+#        BIN=/path/to/code BASE=/path/to/old/code bench/hot_key.sh 2000000
+set -e
+BIN=${BIN:-$(pwd)/code}
+[ $# -gt 0 ] || set -- 100000 1000000
+
+printf '%10s %6s %10s %9s %9s %9s\n' values binary op "mean us" "p50" "p99"
+for n in "$@"; do
+    dir=$(mktemp -d)
+    awk -v n="$n" 'BEGIN {
+        print n
+        for (i = 0; i < n; i++) printf "insert hot %d\n", 2 * i
+    }' > "$dir/build.txt"
+    awk -v n="$n" 'BEGIN {
+        srand(1); q = int(n / 10) + 1; print q
+        for (i = 0; i < q; i++) printf "%s hot %d\n", rand() < 0.5 ? "insert" : "delete", int(rand() * 2 * n)
+    }' > "$dir/update.txt"
+    for exe in "$BIN" ${BASE:+"$BASE"}; do
+        name=bin
+        [ "$exe" = "$BIN" ] || name=base
+        rm -rf "$dir/data"
+        (cd "$dir" && "$exe" < build.txt > /dev/null)
+        (cd "$dir" && "$exe" --latency < update.txt 2>&1 > /dev/null) |
+            awk -v n="$n" -v name="$name" '$1 == "insert" || $1 == "delete" {
+                printf "%10d %6s %10s %9s %9s %9s\n", n, name, $1, $3, $4, $6
+            }'
+    done
+    rm -rf "$dir"
+done
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Lookahead optimizer (--lookahead) on a producer-style stream.
+# Each step of the stream inserts a value and soon deletes it again, and repeats a find
+# of a popular key, over KEYS keys holding N values in total. The same stream runs with
+# and without the optimizer; the outputs must match, and the table shows the run times
+# and how many commands the optimizer dropped or answered from an earlier find.
+#
+# usage: bench/lookahead.sh [N]     (default: 200000 commands)
+#        BIN=/path/to/code KEYS=50 WINDOW=4096 bench/lookahead.sh 2000000
+set -e
+BIN=${BIN:-$(pwd)/code}
+KEYS=${KEYS:-20}
+WINDOW=${WINDOW:-1024}
+n=${1:-200000}
+
+dir=$(mktemp -d)
+awk -v n="$n" -v keys="$KEYS" 'BEGIN {
+    srand(1); print n
+    for (i = 0; i < n; i += 5) {
+        k = int(rand() * keys); v = int(rand() * 100000)
+        printf "insert key%d %d\ninsert key%d %d\nfind key0\ndelete key%d %d\nfind key0\n", k, i, k, v, k, v
+    }
+}' > "$dir/stream.txt"
+
+printf '%10s %10s %s\n' lookahead seconds stats
+for w in 0 "$WINDOW"; do
+    rm -rf "$dir/data"
+    start=$(date +%s.%N)
+    stats=$(cd "$dir" && "$BIN" --lookahead "$w" --stats < stream.txt 2>&1 > "out.$w" | grep '^lookahead' || true)
+    end=$(date +%s.%N)
+    awk -v w="$w" -v t0="$start" -v t1="$end" -v s="$stats" 'BEGIN { printf "%10d %10.3f %s\n", w, t1 - t0, s }'
+done
+cmp -s "$dir/out.0" "$dir/out.$WINDOW" || { echo "outputs differ" >&2; rm -rf "$dir"; exit 1; }
+rm -rf "$dir"
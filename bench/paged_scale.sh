@@ -0,0 +1,34 @@
+#!/bin/sh
+# Scaling benchmark for the paged engine (--paged).
+# Builds a dataset of N entries with random inserts, then replays N/10 random finds
+# and reports page fetches per op; with a bounded pool this should track the tree
+# height, i.e. grow with log(N) rather than N.
+#
+# usage: bench/paged_scale.sh [N ...]     (default: 10000 100000 1000000)
+#        BIN=/path/to/code POOL=256 bench/paged_scale.sh 100000000
+set -e
+BIN=${BIN:-$(pwd)/code}
+POOL=${POOL:-256}
+[ $# -gt 0 ] || set -- 10000 100000 1000000
+
+printf '%12s %8s %14s %12s %10s\n' entries height fetches/op reads/op seconds
+for n in "$@"; do
+    dir=$(mktemp -d)
+    awk -v n="$n" 'BEGIN {
+        srand(1); print n
+        for (i = 0; i < n; i++) printf "insert key%d %d\n", int(rand() * n / 4), i
+    }' > "$dir/build.txt"
+    awk -v n="$n" 'BEGIN {
+        srand(2); q = int(n / 10) + 1; print q
+        for (i = 0; i < q; i++) printf "find key%d\n", int(rand() * n / 4)
+    }' > "$dir/find.txt"
+    (cd "$dir" && "$BIN" --paged --pool-pages "$POOL" < build.txt > /dev/null)
+    start=$(date +%s.%N)
+    stats=$(cd "$dir" && "$BIN" --paged --pool-pages "$POOL" --stats < find.txt 2>&1 > /dev/null)
+    end=$(date +%s.%N)
+    echo "$stats" | grep '^paged: entries' | awk -v t0="$start" -v t1="$end" '{
+        for (i = 1; i <= NF; i++) { split($i, kv, "="); v[kv[1]] = kv[2] }
+        printf "%12d %8d %14s %12s %10.3f\n", v["entries"], v["height"], v["fetches/op"], v["reads/op"], t1 - t0
+    }'
+    rm -rf "$dir"
+done
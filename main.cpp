@@ -1,4 +1,14 @@
 #include <bits/stdc++.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FILESTORE_X86 1
+#endif
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 using namespace std;
 
 /*
@@ -8,243 +18,5093 @@ Optimized design v3:
 - 20 bucket files under data/ directory: data/bk_0.dat ... data/bk_19.dat
 - Small LRU cache of bucket contents (capacity = 6) to balance time vs memory
 - Binary on-disk format for fast load/flush
-  Header: 'BK1\0' (4 bytes)
-  Repeated records: [u8 key_len][key bytes][u32 count][count * i32 values]
+  Header: 'BK2' [u8 flags] [u32 base_bytes] (size of header + base records)
+  Repeated records: [key_len][key bytes][u32 count][count * i32 values]
   Values are sorted ascending and unique.
+  Journal (after base_bytes): [u8 op 'I'/'D'][key_len][key bytes][i32 value]
+  key_len is a LEB128 varint when flags has BK_FLAG_VARINT_KLEN (always set by this
+  writer; keys under 128 bytes take the one-byte fast path), a plain u8 otherwise.
+- TTL: `expire <index> <seconds>` gives a key a deadline (0 clears it). Images of buckets
+  holding TTLs set BK_FLAG_TTL: record key_len becomes (len << 1 | has_ttl) and a u32
+  unix deadline follows the key. Expired keys read as absent (lazy), are dropped before
+  a mutation touches them (journal op 'X'), and are left out of the next full rewrite.
+  Journal op 'E' records a new deadline in its value field.
+  Small runs append their mutations to the journal; a run folds it back into the
+  base image (full rewrite) once it outgrows max(16 KiB, base/2).
+  'BK1\0' files (records only, no journal) are still read.
+- Optional compression (--compress): 'BK3' [u8 flags] [u32 base_bytes][u32 raw_bytes][LZ block]
+  holds the same records with each value list as varint deltas, then LZ-compressed with a
+  built-in LZ4-style block codec; the journal follows unchanged.
 - Fallback: if header missing, read legacy text format (index\tcount\tvals) then rewrite as binary on next flush.
+- fsck (--fsck [--repair]): validates headers, record bounds, value order, duplicate and
+  misplaced keys and journals one bucket at a time, and pages.dat page by page; repair
+  rewrites damaged buckets from the records that survive.
+- filestore-inspect (CMake target, same source with -DFILESTORE_INSPECT) reports per-bucket
+  format, sizes, key/value counts, empty keys, the value-count distribution, the largest
+  keys and hash skew, reading one bucket at a time.
+- Allocation-free steady state: command, key and journal buffers are reused, LRU touches
+  relink nodes, and posting lists reuse released size-class blocks, so a warm run
+  makes no malloc calls (--alloc-warmup N counts them after N commands;
+  bench/alloc_check.sh asserts zero).
+- Posting lists live in size classes eight to a power of two (slabs for blocks up to
+  64 B) and grow one class at a time, so capacity stays within ~12.5% of the values
+  held; full rewrites shrink and repack them. --stats / --metrics report payload vs
+  held bytes and per-class slab fill.
+- Prewarming (--prewarm): per-bucket access counts are folded into a decayed heat score
+  in data/heat at exit; the next run's background thread reads the hottest buckets while
+  the first commands are parsed, and the cache adopts them on first access.
+- Online reshard (--reshard N): keys move from the current bucket layout to one with N
+  buckets, one old bucket every 256 commands; reads route by layout.migrated, so both
+  layouts serve until the move completes. Non-default layouts name files
+  bk_<n>_<i>.dat and are recorded in data/layout.
+- Radix index (CMake -DFILESTORE_ART=ON): buckets index keys in an adaptive radix tree
+  (path-compressed Node4/16/48/256) instead of the hash map; buckets are then written in
+  key order. bench/art_lookup.sh compares find latency of the two builds.
+- Hot keys: a posting list past 4096 values is split into value-range shards stored as
+  records <key>\x1e<lower bound>, listed by a directory record <key>\x1e; updates touch
+  one shard and find concatenates them (bench/hot_key.sh).
+- Response encoding (--encode delta|lz): find / set query answers as [varint count]
+  [varint deltas] (count 0 = null), or the decimal text cut into LZ frames, after an
+  "FSE" + format-byte header; filestore-decode (CMake target, -DFILESTORE_DECODE) turns
+  either back into text. Decimal text stays the default.
+- Lookahead (--lookahead N): commands are parsed N at a time; per key, a mutation of a
+  value superseded by a later one with no read in between is dropped, and a find with
+  no surviving write since the previous find reprints its response. Output is unchanged
+  (bench/lookahead.sh checks it).
+- Portable build: SIMD kernels (posting-list search, token scanning) are compiled for
+  SSE4.2 / AVX2 / AVX-512 and picked once at startup via cpuid; scalar fallback elsewhere.
+- Huge dataset mode (--paged): a B+ tree of (key, value) pairs in data/pages.dat behind a
+  bounded buffer pool; --paged-import converts the bucket files with an external merge sort.
+- Namespaces: `use <ns>` switches the tenant for the following commands; keys are stored
+  as ns + '\x1f' + key in the same engine (the default namespace stores keys unchanged).
+  `use -` switches back to the default namespace.
+  The paged buffer pool is shared by all tenants and split fairly between active ones.
+- Multiple data directories (--data-dir, repeatable): buckets are placed on a consistent
+  hash ring over the directories; a bucket found outside its ring directory is migrated
+  when it is next loaded (or eagerly with --rebalance), and exit-time flushes run one
+  thread per directory.
+- Router mode (--router N): the process forks N workers over pipes; worker k owns the
+  buckets with bucket_id % N == k, `use` is broadcast, and find responses are merged
+  back in input order.
+- Set queries: `intersect <a> <b>` / `union <a> <b>` print the values common to / in
+  either posting list (same format as find); intersection gallops through the longer
+  list when sizes are lopsided. Under --router, the router combines operands that live
+  on two workers.
+- Latency (--latency): each command kind, bucket load miss and flush (journal append vs
+  full rewrite) is timed into an HDR-style log-linear histogram; percentile tables go to
+  stderr at exit and on SIGUSR1.
+- Metrics (--metrics FILE): cache hit rate, resident/dirty bytes, bucket file sizes,
+  flush counts, bytes read/written and command counters in Prometheus text format,
+  rewritten atomically every --metrics-interval seconds and at exit.
+- Tracing (--trace FILE): bucket loads, file reads/writes, evictions and commands are
+  recorded as spans in per-thread rings and written as Chrome trace-event JSON at exit.
+- Replication: --replicate-to SOCK streams every effective mutation (journal entry format,
+  namespace-qualified keys) to a standby in batched frames [u32 bytes][entries];
+  --standby SOCK listens, applies the frames to its own data directory, and flushes
+  when a primary disconnects.
+- Backups: --backup DIR adds a point to DIR after the run; a bucket is copied only when
+  its file changed since the previous point (per-bucket generation = point holding its
+  copy, kept in DIR/superblock), and pages.dat only ships the pages its change map
+  marks. --restore DIR [--point K | --at UNIXTIME] rebuilds the data directories.
 
-Memory: at most 6 buckets cached concurrently to respect ~6 MiB limit.
+Memory: the bucket cache holds up to cache_cap() buckets -- every slot of the layout (20
+by default, both layouts while a reshard runs) -- evicting least recently used buckets with
+a flush past that. Posting lists are held within ~12.5% of their values in size-class
+blocks, and a hot key's update moves at most one shard. Prewarm staging holds at most
+cache_cap() buckets until adopted; --rebalance reads misplaced buckets on one thread per
+source directory straight into the cache; router workers each cache only the buckets
+they own. --paged bounds the engine to --pool-pages * 4 KiB, and a standby buffers one
+replication frame of at most 1 MiB.
 */
 
+// Encodings of find / set query responses (--encode)
+enum Encoding { ENC_TEXT, ENC_DELTA, ENC_LZ };
+
+// Runtime options; the judge runs the binary without arguments, which selects the defaults
+struct Options {
+    bool compress = false;     // write BK3 (delta + LZ) base images
+    bool paged = false;        // serve commands from the paged B+ tree engine
+    bool paged_import = false; // convert the bucket files into the paged engine and exit
+    size_t pool_pages = 256;   // paged buffer pool size (4 KiB pages)
+    bool stats = false;        // print engine counters to stderr at exit
+    vector<string> data_dirs;  // bucket directories; the first also holds pages.dat ("data")
+    bool rebalance = false;    // migrate every misplaced bucket at startup
+    int router = 0;            // > 0: fan commands out to this many worker processes
+    bool worker = false;       // set in forked workers: read commands until EOF, no count line
+    string replicate_to;       // unix socket of a standby to stream mutations to
+    string standby;            // run as a standby listening on this unix socket
+    string backup;             // add a backup point here after the run
+    string restore;            // restore from this backup directory and exit
+    long restore_point = -1;
+    long long restore_at = LLONG_MAX;
+    bool latency = false;      // per-command latency histograms, printed at exit and on SIGUSR1
+    string metrics;            // Prometheus text file refreshed while running
+    string trace;              // Chrome trace-event JSON written at exit
+    double metrics_interval = 1;
+    int worker_index = 0;      // which router worker this process is
+    bool fsck = false;         // check the data directories and exit
+    bool repair = false;       // with --fsck: rewrite damaged buckets from what survives
+    long alloc_warmup = -1;    // >= 0: count allocations after this many commands
+    bool prewarm = false;      // prefetch buckets that were hot in earlier runs; keep data/heat
+    int reshard = 0;           // > 0: migrate to a layout with this many buckets
+    Encoding encode = ENC_TEXT; // response encoding on stdout
+    int lookahead = 0;         // > 1: optimize windows of this many commands before running them
+};
+static Options opt;
+
+// Allocation accounting (--alloc-warmup N): operator new is counted once the first N
+// commands have run, so a warm replay can check that steady-state commands allocate
+// nothing (bench/alloc_check.sh). Counting is off otherwise: one relaxed load per new.
+static atomic<bool> alloc_counting{false};
+static atomic<uint64_t> alloc_count{0};
+
+static void count_alloc() {
+    if (alloc_counting.load(memory_order_relaxed)) alloc_count.fetch_add(1, memory_order_relaxed);
+}
+
+static void *counted_malloc(size_t n) {
+    count_alloc();
+    if (void *p = malloc(n ? n : 1)) return p;
+    abort(); // built with -fno-exceptions: nothing could catch bad_alloc
+}
+
+void *operator new(size_t n) { return counted_malloc(n); }
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
 static const int NUM_BUCKETS = 20; // stay within 20-file limit
 static const int BUCKET_CACHE_CAP = NUM_BUCKETS; // cache all buckets to avoid evictions
-static const string DATA_DIR = "data";
+
+// Consistent-hash ring over opt.data_dirs with RING_VNODES points per directory, so
+// adding a directory moves only about 1/n of the buckets.
+static const int RING_VNODES = 64;
+static vector<pair<uint64_t, int>> ring; // (point, data dir index), sorted
+
+static uint64_t fnv1a(const string &s) {
+    uint64_t h = 1469598103934665603ull;
+    for (unsigned char c : s) h = (h ^ c) * 1099511628211ull;
+    // fmix64 finalizer: FNV alone leaves the high bits of near-identical names clustered
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static void build_ring() {
+    if (opt.data_dirs.empty()) opt.data_dirs.push_back("data");
+    ring.clear();
+    for (int d = 0; d < (int)opt.data_dirs.size(); ++d) {
+        for (int v = 0; v < RING_VNODES; ++v) ring.emplace_back(fnv1a(opt.data_dirs[d] + "#" + to_string(v)), d);
+    }
+    sort(ring.begin(), ring.end());
+}
+
+static const string &primary_dir() {
+    return opt.data_dirs[0];
+}
+
+// Bucket layouts (--reshard N): keys hash into layout.from buckets, or, while a reshard
+// to layout.to buckets is under way, into the new layout once their old bucket has been
+// migrated (old buckets move in index order; layout.migrated of them are done). Buckets
+// are numbered as slots: old layout 0..from-1, new layout from..from+to-1. The default
+// 20-bucket layout keeps its bk_<i>.dat names and needs no marker; any other layout
+// names its files bk_<n>_<i>.dat and is recorded in data/layout as
+//   LAYOUT1 <from> <to> <migrated>
+static const int MAX_BUCKETS = 1024;
+static const int MAX_SLOTS = 2 * MAX_BUCKETS;
+
+struct Layout {
+    int from = NUM_BUCKETS, to = 0, migrated = 0;
+};
+
+static Layout layout;
+
+static int slot_count() {
+    return layout.from + layout.to;
+}
+
+static string layout_path() {
+    return primary_dir() + "/layout";
+}
+
+static bool read_layout(const string &path, Layout &l) {
+    l = Layout();
+    FILE *fp = fopen(path.c_str(), "r");
+    if (!fp) return false;
+    Layout r;
+    bool ok = fscanf(fp, "LAYOUT1 %d %d %d", &r.from, &r.to, &r.migrated) == 3 && r.from > 0 &&
+              r.from <= MAX_BUCKETS && r.to >= 0 && r.to <= MAX_BUCKETS && r.to != r.from &&
+              r.migrated >= 0 && r.migrated <= r.from;
+    fclose(fp);
+    if (ok) l = r;
+    return ok;
+}
+
+static void write_layout() {
+    string path = layout_path(), tmp = path + ".tmp";
+    error_code ec;
+    if (layout.from == NUM_BUCKETS && !layout.to) {
+        filesystem::remove(path, ec);
+        return;
+    }
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (!fp) return;
+    fprintf(fp, "LAYOUT1 %d %d %d\n", layout.from, layout.to, layout.migrated);
+    fclose(fp);
+    filesystem::rename(tmp, path, ec);
+}
+
+static string bucket_name(int b) {
+    int n = layout.from, i = b;
+    if (b >= layout.from) {
+        n = layout.to;
+        i = b - layout.from;
+    }
+    return n == NUM_BUCKETS ? "bk_" + to_string(i) : "bk_" + to_string(n) + "_" + to_string(i);
+}
+
+static int bucket_dir_index(int b) {
+    if (opt.data_dirs.size() == 1) return 0;
+    auto it = lower_bound(ring.begin(), ring.end(), make_pair(fnv1a(bucket_name(b)), 0));
+    return it == ring.end() ? ring.front().second : it->second;
+}
+
+static string bucket_file(const string &dir, int b) {
+    return dir + "/" + bucket_name(b) + ".dat";
+}
 
 static string bucket_path(int b) {
-    return DATA_DIR + "/bk_" + to_string(b) + ".dat";
+    return bucket_file(opt.data_dirs[bucket_dir_index(b)], b);
+}
+
+// Where bucket b lives now: its ring directory, or one it has not been migrated out of yet
+static string locate_bucket(int b) {
+    string path = bucket_path(b);
+    if (opt.data_dirs.size() == 1 || filesystem::exists(path)) return path;
+    for (const string &dir : opt.data_dirs) {
+        string p = bucket_file(dir, b);
+        if (filesystem::exists(p)) return p;
+    }
+    return path;
+}
+
+// Records of a sharded key are named <key> SHARD_SEP [<lower bound>] (see bucket_insert);
+// they hash and expire as <key>, so all of them share its bucket
+static const char SHARD_SEP = '\x1e'; // never part of an input token (<= ' ')
+
+static size_t logical_len(const string &key) {
+    const void *sep = memchr(key.data(), SHARD_SEP, key.size());
+    return sep ? (size_t)(static_cast<const char*>(sep) - key.data()) : key.size();
+}
+
+static string logical_key(const string &key) {
+    return key.substr(0, logical_len(key));
+}
+
+static bool is_shard_dir(const string &key) {
+    return !key.empty() && key.back() == SHARD_SEP;
+}
+
+// Same value as std::hash<string> for unsharded keys
+static size_t key_hash(const string &key) {
+    return std::hash<string_view>{}(string_view(key.data(), logical_len(key)));
 }
 
 static int bucket_id(const string &key) {
-    size_t h = std::hash<string>{}(key);
-    return (int)(h % NUM_BUCKETS);
+    size_t h = key_hash(key);
+    int b = (int)(h % layout.from);
+    return b < layout.migrated ? layout.from + (int)(h % layout.to) : b;
 }
 
-struct Bucket {
-    // index -> sorted unique values
-    unordered_map<string, vector<int>> map;
-    bool dirty = false;
+// Cache capacity: every bucket, as with the default layout
+static int cache_cap() {
+    return max(BUCKET_CACHE_CAP, slot_count());
+}
+
+// CPU dispatch: ISA-specific kernels selected once in init_cpu_dispatch()
+// lower_bound: first index i in sorted a[0..n) with a[i] >= v
+// token_end: first byte <= ' ' starting at p (caller guarantees a sentinel and 64 bytes of slack)
+struct CpuKernels {
+    size_t (*lower_bound)(const int *a, size_t n, int v);
+    const char *(*token_end)(const char *p);
+    const char *isa;
 };
 
-// Fallback text parser: index\tcount\tval1 val2 ... (values are already sorted unique)
-static bool parse_line_fast(const string &line, string &index_out, vector<int> &vals_out) {
-    size_t p1 = line.find('\t');
-    if (p1 == string::npos) return false;
-    size_t p2 = line.find('\t', p1 + 1);
-    if (p2 == string::npos) return false;
-    index_out.assign(line.data(), p1);
-    vals_out.clear();
-    const char *s = line.c_str() + p2 + 1;
-    char *endptr = nullptr;
-    while (*s) {
-        while (*s == ' ') ++s;
-        if (!*s) break;
-        long v = strtol(s, &endptr, 10);
-        if (s == endptr) break;
-        vals_out.push_back((int)v);
-        s = endptr;
+static size_t lower_bound_scalar(const int *a, size_t n, int v) {
+    return (size_t)(std::lower_bound(a, a + n, v) - a);
+}
+
+static const char *token_end_scalar(const char *p) {
+    while ((unsigned char)*p > ' ') ++p;
+    return p;
+}
+
+#ifdef FILESTORE_X86
+// Binary search narrows to a small window, then a vector compare counts elements < v
+// (values are sorted, so the "less than" mask is a run of low bits).
+__attribute__((target("sse4.2")))
+static size_t lower_bound_sse42(const int *a, size_t n, int v) {
+    size_t lo = 0;
+    while (n > 16) {
+        size_t half = n / 2;
+        if (a[lo + half] < v) { lo += half + 1; n -= half + 1; }
+        else n = half;
     }
-    return true;
+    const __m128i key = _mm_set1_epi32(v);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + lo + i));
+        unsigned m = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(key, x)));
+        if (m != 0xF) return lo + i + __builtin_ctz(~m);
+    }
+    while (i < n && a[lo + i] < v) ++i;
+    return lo + i;
 }
 
-// LRU cache: bucket id -> Bucket
-static unordered_map<int, Bucket> cache;
-static list<int> lru; // front = most recent, back = least recent
-static unordered_map<int, list<int>::iterator> where;
+__attribute__((target("sse4.2")))
+static const char *token_end_sse42(const char *p) {
+    const __m128i sp = _mm_set1_epi8(' ');
+    for (;; p += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(x, sp), x));
+        if (m) return p + __builtin_ctz(m);
+    }
+}
 
-static void touch_lru(int b) {
-    auto it = where.find(b);
-    if (it != where.end()) {
-        lru.erase(it->second);
-        lru.push_front(b);
-        it->second = lru.begin();
-    } else {
-        lru.push_front(b);
-        where[b] = lru.begin();
+__attribute__((target("avx2")))
+static size_t lower_bound_avx2(const int *a, size_t n, int v) {
+    size_t lo = 0;
+    while (n > 32) {
+        size_t half = n / 2;
+        if (a[lo + half] < v) { lo += half + 1; n -= half + 1; }
+        else n = half;
     }
+    const __m256i key = _mm256_set1_epi32(v);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + lo + i));
+        unsigned m = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(key, x)));
+        if (m != 0xFF) return lo + i + __builtin_ctz(~m);
+    }
+    while (i < n && a[lo + i] < v) ++i;
+    return lo + i;
 }
 
-// Binary load/flush
-static bool load_bucket_binary_file(const string &path, Bucket &bk) {
-    ifstream fin(path, ios::binary);
-    if (!fin.good()) return true; // empty is ok
-    char hdr[4];
-    if (!fin.read(hdr, 4)) return false;
-    if (!(hdr[0]=='B' && hdr[1]=='K' && hdr[2]=='1' && hdr[3]=='\0')) return false;
-    bk.map.reserve(1024);
-    while (true) {
-        unsigned char klen = 0;
-        if (!fin.read(reinterpret_cast<char*>(&klen), 1)) break; // EOF
-        string key;
-        key.resize(klen);
-        if (klen && !fin.read(&key[0], klen)) return false;
-        uint32_t cnt = 0;
-        if (!fin.read(reinterpret_cast<char*>(&cnt), 4)) return false;
-        vector<int> vals(cnt);
-        if (cnt) {
-            if (!fin.read(reinterpret_cast<char*>(vals.data()), cnt * sizeof(int))) return false;
-        }
-        bk.map.emplace(std::move(key), std::move(vals));
+__attribute__((target("avx2")))
+static const char *token_end_avx2(const char *p) {
+    const __m256i sp = _mm256_set1_epi8(' ');
+    for (;; p += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(x, sp), x));
+        if (m) return p + __builtin_ctz(m);
     }
-    return true;
 }
 
-static bool load_bucket_text_file(const string &path, Bucket &bk) {
-    ifstream fin(path);
-    if (!fin.good()) return true; // treat as empty
-    string line, idx;
-    vector<int> vals;
-    bk.map.reserve(1024);
-    while (getline(fin, line)) {
-        if (!line.empty() && line.back() == '\r') line.pop_back();
-        if (!parse_line_fast(line, idx, vals)) continue;
-        bk.map.emplace(idx, vals);
+__attribute__((target("avx512f,avx512bw")))
+static size_t lower_bound_avx512(const int *a, size_t n, int v) {
+    size_t lo = 0;
+    while (n > 64) {
+        size_t half = n / 2;
+        if (a[lo + half] < v) { lo += half + 1; n -= half + 1; }
+        else n = half;
     }
-    return true;
+    const __m512i key = _mm512_set1_epi32(v);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i x = _mm512_loadu_si512(a + lo + i);
+        unsigned m = (unsigned)_mm512_cmplt_epi32_mask(x, key);
+        if (m != 0xFFFF) return lo + i + __builtin_ctz(~m);
+    }
+    while (i < n && a[lo + i] < v) ++i;
+    return lo + i;
 }
 
-static void flush_bucket_binary_file(const string &path, const Bucket &bk) {
-    filesystem::create_directories(DATA_DIR);
-    string tmp = path + ".tmp";
-    {
-        ofstream fout(tmp, ios::binary);
-        const char hdr[4] = {'B','K','1','\0'};
-        fout.write(hdr, 4);
-        for (const auto &kv : bk.map) {
-            const string &key = kv.first;
-            const vector<int> &vals = kv.second;
-            unsigned char klen = (unsigned char)(key.size() & 0xFF);
-            fout.write(reinterpret_cast<const char*>(&klen), 1);
-            if (klen) fout.write(key.data(), klen);
-            uint32_t cnt = (uint32_t)vals.size();
-            fout.write(reinterpret_cast<const char*>(&cnt), 4);
-            if (cnt) fout.write(reinterpret_cast<const char*>(vals.data()), cnt * sizeof(int));
+__attribute__((target("avx512f,avx512bw")))
+static const char *token_end_avx512(const char *p) {
+    const __m512i sp = _mm512_set1_epi8(' ');
+    for (;; p += 64) {
+        __m512i x = _mm512_loadu_si512(p);
+        unsigned long long m = _mm512_cmple_epu8_mask(x, sp);
+        if (m) return p + __builtin_ctzll(m);
+    }
+}
+#endif
+
+static CpuKernels kern = {lower_bound_scalar, token_end_scalar, "scalar"};
+
+static void init_cpu_dispatch() {
+#ifdef FILESTORE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        kern = {lower_bound_avx512, token_end_avx512, "avx512"};
+    } else if (__builtin_cpu_supports("avx2")) {
+        kern = {lower_bound_avx2, token_end_avx2, "avx2"};
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        kern = {lower_bound_sse42, token_end_sse42, "sse4.2"};
+    }
+#endif
+}
+
+static void lz_compress(const char *src, size_t n, string &dst);
+
+// Response output. Under --encode lz every flush becomes one frame
+// [u32 raw_bytes][u32 packed_bytes][LZ block] (the bucket files' LZ codec).
+struct OutputWriter {
+    static const size_t BUF = 1 << 16;
+    char buf[BUF];
+    size_t len = 0;
+    uint64_t flushes = 0; // writes to stdout so far
+    string frame;         // reused LZ frame
+
+    void emit(const char *s, size_t n) {
+        ++flushes;
+        if (opt.encode != ENC_LZ) {
+            fwrite(s, 1, n, stdout);
+            return;
         }
-        fout.flush();
+        frame.assign(8, '\0');
+        lz_compress(s, n, frame);
+        uint32_t raw = (uint32_t)n, packed = (uint32_t)(frame.size() - 8);
+        memcpy(&frame[0], &raw, 4);
+        memcpy(&frame[4], &packed, 4);
+        fwrite(frame.data(), 1, frame.size(), stdout);
     }
-    std::error_code ec;
-    filesystem::rename(tmp, path, ec);
-    if (ec) {
-        filesystem::remove(path);
-        filesystem::rename(tmp, path);
+    void flush() {
+        if (len) emit(buf, len);
+        len = 0;
+    }
+    void put(char c) {
+        if (len == BUF) flush();
+        buf[len++] = c;
+    }
+    void put(const char *s, size_t n) {
+        if (len + n > BUF) flush();
+        if (n > BUF) { // e.g. a router passing on a whole hot key's find line
+            emit(s, n);
+            return;
+        }
+        memcpy(buf + len, s, n);
+        len += n;
+    }
+    void put_int(int v) {
+        if (len + 12 > BUF) flush();
+        char tmp[12];
+        int n = 0;
+        unsigned u = (unsigned)v;
+        if (v < 0) { buf[len++] = '-'; u = 0u - u; }
+        do { tmp[n++] = (char)('0' + u % 10); u /= 10; } while (u);
+        while (n) buf[len++] = tmp[--n];
+    }
+    void put_varint(uint32_t v) {
+        if (len + 5 > BUF) flush();
+        while (v >= 0x80) {
+            buf[len++] = (char)(v | 0x80);
+            v >>= 7;
+        }
+        buf[len++] = (char)v;
+    }
+};
+
+static OutputWriter out;
+
+// One response: decimal text ("null" when empty), or under --encode delta
+// [varint n][varint v0][varint v1 - v0]... with n = 0 for null (differences mod 2^32)
+static void print_values(const int *v, size_t n) {
+    if (opt.encode == ENC_DELTA) {
+        out.put_varint((uint32_t)n);
+        uint32_t prev = 0;
+        for (size_t i = 0; i < n; ++i) {
+            out.put_varint((uint32_t)v[i] - prev);
+            prev = (uint32_t)v[i];
+        }
+        return;
+    }
+    if (!n) out.put("null", 4);
+    for (size_t i = 0; i < n; ++i) {
+        if (i) out.put(' ');
+        out.put_int(v[i]);
     }
+    out.put('\n');
 }
 
-static void flush_bucket_to_disk(int b, const Bucket &bk) {
-    if (!bk.dirty) return;
-    string path = bucket_path(b);
-    flush_bucket_binary_file(path, bk);
+// Encoded response streams start with "FSE" and a format byte: 'D' (delta), 'Z' (lz)
+static void write_stream_header() {
+    if (opt.encode == ENC_TEXT) return;
+    const char hdr[4] = {'F', 'S', 'E', opt.encode == ENC_DELTA ? 'D' : 'Z'};
+    fwrite(hdr, 1, 4, stdout);
+    fflush(stdout); // before any fork, so workers do not inherit it
 }
 
-static void evict_if_needed() {
-    if ((int)cache.size() < BUCKET_CACHE_CAP) return;
-    // Evict least recently used (back)
-    int victim = lru.back();
-    lru.pop_back();
-    where.erase(victim);
-    auto it = cache.find(victim);
-    if (it != cache.end()) {
-        flush_bucket_to_disk(victim, it->second);
-        cache.erase(it);
+// Buffered stdin tokenizer; buf[len] is always a ' ' sentinel for token_end
+struct InputReader {
+    static const size_t BUF = 1 << 16;
+    static const size_t PAD = 64;
+    char buf[BUF + PAD];
+    size_t pos = 0, len = 0;
+    bool eof = false;
+
+    void refill() {
+        size_t rem = len - pos;
+        if (rem) memmove(buf, buf + pos, rem);
+        pos = 0;
+        len = rem;
+        if (!eof) {
+            out.flush(); // answer everything asked so far before possibly blocking on input
+            size_t got = fread(buf + len, 1, BUF - len, stdin);
+            if (got == 0) eof = true;
+            len += got;
+        }
+        buf[len] = ' ';
     }
-}
 
-static Bucket &load_bucket(int b) {
-    auto it = cache.find(b);
-    if (it != cache.end()) {
-        touch_lru(b);
-        return it->second;
+    // True when the next token needs a read from stdin (which may block)
+    bool drained() {
+        while (pos < len && (unsigned char)buf[pos] <= ' ') ++pos;
+        return pos >= len && !eof;
     }
-    evict_if_needed();
-    Bucket bk;
-    string path = bucket_path(b);
-    bool ok = load_bucket_binary_file(path, bk);
-    if (!ok) {
-        bk.map.clear();
-        load_bucket_text_file(path, bk);
+
+    bool token(string &out) {
+        for (;;) {
+            while (pos < len && (unsigned char)buf[pos] <= ' ') ++pos;
+            if (pos < len) break;
+            if (eof) return false;
+            refill();
+        }
+        out.clear();
+        for (;;) {
+            size_t end = (size_t)(kern.token_end(buf + pos) - buf);
+            out.append(buf + pos, end - pos);
+            pos = end;
+            if (end < len || eof) return true;
+            refill();
+            if (len == 0) return true;
+        }
     }
-    bk.dirty = false;
-    auto [insIt, _] = cache.emplace(b, std::move(bk));
-    touch_lru(b);
-    return insIt->second;
+
+    bool integer(int &v) {
+        if (!token(num)) return false;
+        long r = 0;
+        for (char c : num) r = r * 10 + (c - '0');
+        v = (int)r;
+        return true;
+    }
+
+    string num;
+};
+
+static InputReader in;
+
+static const size_t JOURNAL_MAX_PENDING = 1024;       // more mutations than this -> rewrite
+static const uint64_t JOURNAL_FOLD_MIN = 16 << 10;    // journal may always grow to this size
+
+// Posting-list storage: value vectors allocate through PostingAllocator in size classes
+// eight to a power of two (capacities 2..16 ints exactly, then 18, 20, ..., 32, 36, ...),
+// so a block is at most 12.5% larger than the list it holds, and bucket_insert grows a
+// full list by one class instead of doubling it. Blocks up to POSTING_SLAB_MAX_BLOCK are
+// carved from POSTING_SLAB-byte slabs, one class per slab, where malloc's per-chunk header
+// and 32-byte minimum would otherwise double their size; a slab knows its class and
+// live-block count, goes back to free() once empty (one empty slab per class is kept),
+// and is found from a block by masking the address. Larger blocks are malloc'd at their
+// class size, with released ones kept on per-class free lists up to the larger of
+// POSTING_POOL_MIN and 1/16 of the large blocks in use, so growth can reuse them.
+// Full rewrites compact: lists that deletes left more than one class too large shrink,
+// and lists in slabs under half full move out so those slabs can be released.
+static const size_t POSTING_SLAB = 4 << 10;
+static const size_t POSTING_SLAB_MAX_BLOCK = 64;
+static const int POSTING_CLASSES = 128; // capacities up to 256 Ki ints (1 MiB)
+static const size_t POSTING_POOL_MIN = 32 << 10;
+
+struct PostingSlab {
+    PostingSlab *prev = nullptr, *next = nullptr; // the class's slabs with free blocks
+    void *free = nullptr;                         // released blocks
+    uint32_t carved = 0;                          // blocks handed out from fresh space so far
+    uint32_t live = 0;
+    int cls = 0;
+};
+
+struct PostingClassStats {
+    uint64_t live = 0;  // blocks in use
+    uint64_t slabs = 0; // slabs owned (slabbed classes)
+    uint64_t cached = 0; // released large blocks kept for reuse
+};
+
+struct PostingPool {
+    mutex mu; // rebalance readers build buckets on their own threads
+    PostingSlab *partial[POSTING_CLASSES] = {}; // head allocates first; sparse slabs sit at the tail
+    PostingSlab *partial_tail[POSTING_CLASSES] = {};
+    PostingSlab *spare[POSTING_CLASSES] = {}; // one emptied slab per class, kept for reuse
+    void *free_list[POSTING_CLASSES] = {}; // large classes
+    size_t free_bytes = 0;
+    size_t large_bytes = 0; // large blocks in use
+    size_t huge_bytes = 0;  // blocks above the largest class, malloc'd as requested
+    PostingClassStats stats[POSTING_CLASSES];
+};
+
+static PostingPool posting_pool;
+
+static size_t posting_class_cap(int c) {
+    if (c < 16) return (size_t)max(c + 1, 2);
+    int k = 4 + (c - 16) / 8, sub = (c - 16) % 8;
+    return (size_t)(8 + sub + 1) << (k - 3);
 }
 
-static void cmd_insert(const string &idx, int val) {
-    int b = bucket_id(idx);
-    Bucket &bk = load_bucket(b);
-    auto &vec = bk.map[idx]; // creates empty if not exists
-    auto it = lower_bound(vec.begin(), vec.end(), val);
-    if (it == vec.end() || *it != val) {
-        vec.insert(it, val);
-        bk.dirty = true;
+// Smallest class holding n ints
+static int posting_class(size_t n) {
+    if (n <= 16) return n <= 2 ? 1 : (int)n - 1;
+    int k = 63 - __builtin_clzll(n - 1);
+    return 16 + (k - 4) * 8 + (int)(((n - 1) >> (k - 3)) & 7);
+}
+
+// Capacity a list of n values is allocated with
+static size_t posting_capacity(size_t n) { return n ? posting_class_cap(posting_class(n)) : 0; }
+
+static size_t posting_block_bytes(int c) { return posting_class_cap(c) * sizeof(int); }
+
+static const size_t POSTING_SLAB_HEADER = (sizeof(PostingSlab) + 15) & ~(size_t)15;
+
+static uint32_t posting_slab_blocks(int c) {
+    return (uint32_t)((POSTING_SLAB - POSTING_SLAB_HEADER) / posting_block_bytes(c));
+}
+
+static void posting_unlink(PostingSlab *s) {
+    if (s->prev) s->prev->next = s->next;
+    else posting_pool.partial[s->cls] = s->next;
+    if (s->next) s->next->prev = s->prev;
+    else posting_pool.partial_tail[s->cls] = s->prev;
+    s->prev = s->next = nullptr;
+}
+
+static void posting_push(PostingSlab *s, bool tail) {
+    PostingSlab *&head = posting_pool.partial[s->cls], *&last = posting_pool.partial_tail[s->cls];
+    if (tail) {
+        s->prev = last;
+        s->next = nullptr;
+        (last ? last->next : head) = s;
+        last = s;
+    } else {
+        s->prev = nullptr;
+        s->next = head;
+        (head ? head->prev : last) = s;
+        head = s;
     }
 }
 
-static void cmd_delete(const string &idx, int val) {
-    int b = bucket_id(idx);
-    Bucket &bk = load_bucket(b);
-    auto itIdx = bk.map.find(idx);
-    if (itIdx == bk.map.end()) return;
-    auto &vec = itIdx->second;
-    auto it = lower_bound(vec.begin(), vec.end(), val);
-    if (it != vec.end() && *it == val) {
-        vec.erase(it);
-        bk.dirty = true;
+static void *posting_get(size_t n) {
+    int c = posting_class(n);
+    size_t bytes = posting_block_bytes(c);
+    lock_guard<mutex> lock(posting_pool.mu);
+    if (c >= POSTING_CLASSES) {
+        posting_pool.huge_bytes += n * sizeof(int);
+        return counted_malloc(n * sizeof(int));
+    }
+    PostingClassStats &st = posting_pool.stats[c];
+    if (bytes > POSTING_SLAB_MAX_BLOCK) {
+        ++st.live;
+        posting_pool.large_bytes += bytes;
+        if (void *p = posting_pool.free_list[c]) {
+            posting_pool.free_list[c] = *static_cast<void**>(p);
+            posting_pool.free_bytes -= bytes;
+            --st.cached;
+            return p;
+        }
+        return counted_malloc(bytes);
+    }
+    PostingSlab *s = posting_pool.partial[c];
+    if (!s) {
+        s = posting_pool.spare[c];
+        posting_pool.spare[c] = nullptr;
+        if (!s) {
+            count_alloc();
+            s = static_cast<PostingSlab*>(aligned_alloc(POSTING_SLAB, POSTING_SLAB));
+            if (!s) abort();
+            ++st.slabs;
+        }
+        s = new (s) PostingSlab;
+        s->cls = c;
+        posting_push(s, false);
     }
+    void *p;
+    if (s->free) {
+        p = s->free;
+        s->free = *static_cast<void**>(p);
+    } else {
+        p = reinterpret_cast<char*>(s) + POSTING_SLAB_HEADER + (size_t)s->carved++ * bytes;
+    }
+    ++s->live;
+    ++st.live;
+    if (!s->free && s->carved == posting_slab_blocks(c)) posting_unlink(s); // full
+    return p;
 }
 
-static void cmd_find(const string &idx) {
-    int b = bucket_id(idx);
-    Bucket &bk = load_bucket(b);
-    auto itIdx = bk.map.find(idx);
-    if (itIdx == bk.map.end() || itIdx->second.empty()) {
-        cout << "null\n";
+static void posting_put(void *p, size_t n) {
+    int c = posting_class(n);
+    size_t bytes = posting_block_bytes(c);
+    lock_guard<mutex> lock(posting_pool.mu);
+    if (c >= POSTING_CLASSES) {
+        posting_pool.huge_bytes -= n * sizeof(int);
+        free(p);
+        return;
+    }
+    PostingClassStats &st = posting_pool.stats[c];
+    --st.live;
+    if (bytes > POSTING_SLAB_MAX_BLOCK) {
+        posting_pool.large_bytes -= bytes;
+        if (posting_pool.free_bytes + bytes <= max(POSTING_POOL_MIN, posting_pool.large_bytes / 16)) {
+            *static_cast<void**>(p) = posting_pool.free_list[c];
+            posting_pool.free_list[c] = p;
+            posting_pool.free_bytes += bytes;
+            ++st.cached;
+        } else {
+            free(p);
+        }
         return;
     }
-    const auto &vec = itIdx->second;
-    for (size_t i = 0; i < vec.size(); ++i) {
-        if (i) cout << ' ';
-        cout << vec[i];
+    auto *s = reinterpret_cast<PostingSlab*>(reinterpret_cast<uintptr_t>(p) & ~(uintptr_t)(POSTING_SLAB - 1));
+    bool was_full = !s->free && s->carved == posting_slab_blocks(c);
+    *static_cast<void**>(p) = s->free;
+    s->free = p;
+    --s->live;
+    uint32_t blocks = posting_slab_blocks(c);
+    if (was_full) {
+        posting_push(s, false);
+    } else if (s->live + 1 == blocks / 2 && s->next) {
+        // dropped below half: allocate elsewhere first so this slab can drain and be freed
+        posting_unlink(s);
+        posting_push(s, true);
+    }
+    if (!s->live) {
+        posting_unlink(s);
+        if (!posting_pool.spare[c]) {
+            posting_pool.spare[c] = s;
+        } else {
+            --st.slabs;
+            free(s);
+        }
     }
-    cout << '\n';
 }
 
-int main() {
-    ios::sync_with_stdio(false);
-    cin.tie(nullptr);
+// True when a list's block sits in a slab under half full that is not first in line
+// for allocations; compaction moves such lists so the slab can drain
+static bool posting_sparse(const int *p, size_t cap) {
+    if (!p || posting_block_bytes(posting_class(cap)) > POSTING_SLAB_MAX_BLOCK) return false;
+    auto *s = reinterpret_cast<const PostingSlab*>(reinterpret_cast<uintptr_t>(p) & ~(uintptr_t)(POSTING_SLAB - 1));
+    lock_guard<mutex> lock(posting_pool.mu);
+    return s != posting_pool.partial[s->cls] && s->live * 2 < posting_slab_blocks(s->cls);
+}
 
-    filesystem::create_directories(DATA_DIR);
+// Heap behind the posting lists: live = blocks in use; held = whole slabs, plus large
+// blocks in use or cached
+struct PostingUsage {
+    uint64_t live_bytes = 0, held_bytes = 0, slabs = 0;
+};
 
-    int n;
-    if (!(cin >> n)) return 0;
-    for (int i = 0; i < n; ++i) {
-        string cmd, idx;
-        cin >> cmd >> idx;
-        if (cmd == "insert") {
-            int val; cin >> val;
-            cmd_insert(idx, val);
-        } else if (cmd == "delete") {
-            int val; cin >> val;
-            cmd_delete(idx, val);
-        } else if (cmd == "find") {
-            cmd_find(idx);
-        } else {
-            // invalid command
+static PostingUsage posting_usage() {
+    PostingUsage u;
+    lock_guard<mutex> lock(posting_pool.mu);
+    u.live_bytes = u.held_bytes = posting_pool.huge_bytes;
+    for (int c = 1; c < POSTING_CLASSES; ++c) {
+        const PostingClassStats &st = posting_pool.stats[c];
+        u.live_bytes += st.live * posting_block_bytes(c);
+        if (posting_block_bytes(c) > POSTING_SLAB_MAX_BLOCK) u.held_bytes += (st.live + st.cached) * posting_block_bytes(c);
+        else u.held_bytes += st.slabs * POSTING_SLAB;
+        u.slabs += st.slabs;
+    }
+    return u;
+}
+
+template <class T>
+struct PostingAllocator {
+    using value_type = T;
+    PostingAllocator() = default;
+    template <class U>
+    PostingAllocator(const PostingAllocator<U> &) {}
+    static_assert(sizeof(T) == sizeof(int), "size classes count ints");
+    T *allocate(size_t n) { return static_cast<T*>(posting_get(n)); }
+    void deallocate(T *p, size_t n) { posting_put(p, n); }
+    template <class U>
+    bool operator==(const PostingAllocator<U> &) const { return true; }
+    template <class U>
+    bool operator!=(const PostingAllocator<U> &) const { return false; }
+};
+
+using Postings = vector<int, PostingAllocator<int>>;
+
+#ifdef FILESTORE_ART
+// Adaptive radix tree over byte-string keys (CMake option FILESTORE_ART), standing in for
+// unordered_map<string, V> as the bucket index with the subset of its interface the
+// engine uses; iteration visits keys in byte order. Inner nodes grow 4 -> 16 -> 48 -> 256
+// children and shrink back on erase; Node16 searches its keys with one SSE2 compare.
+// Each inner node keeps its compressed path (the bytes every key below it shares) and a
+// `term` leaf for the key that ends at the node, so keys may be prefixes of each other.
+// A child slot holds an inner node or, tagged with the low bit, a leaf: the
+// pair<const string, V> itself, which iterators point at.
+template <class V>
+class ArtMap {
+public:
+    using value_type = pair<const string, V>;
+
+private:
+    using Ref = uintptr_t;
+    enum Kind : uint8_t { N4, N16, N48, N256 };
+
+    struct Node {
+        Kind kind;
+        uint16_t count = 0;
+        string prefix;
+        value_type *term = nullptr;
+        explicit Node(Kind k) : kind(k) {}
+    };
+    struct Node4 : Node {
+        uint8_t keys[4];
+        Ref child[4];
+        Node4() : Node(N4) {}
+    };
+    struct Node16 : Node {
+        alignas(16) uint8_t keys[16];
+        Ref child[16];
+        Node16() : Node(N16) {}
+    };
+    struct Node48 : Node {
+        uint8_t index[256] = {}; // byte -> slot + 1 (0: none); slots 0..count-1 in use
+        Ref child[48];
+        Node48() : Node(N48) {}
+    };
+    struct Node256 : Node {
+        Ref child[256] = {};
+        Node256() : Node(N256) {}
+    };
+
+    Ref root_ = 0;
+    size_t size_ = 0;
+    size_t node_bytes_ = 0;
+
+    static bool is_leaf(Ref r) { return r & 1; }
+    static value_type *leaf(Ref r) { return reinterpret_cast<value_type*>(r & ~(Ref)1); }
+    static Ref tag(value_type *l) { return reinterpret_cast<Ref>(l) | 1; }
+    static Node *node(Ref r) { return reinterpret_cast<Node*>(r); }
+    static Ref ref(Node *n) { return reinterpret_cast<Ref>(n); }
+
+    template <class N>
+    N *make() {
+        node_bytes_ += sizeof(N);
+        return new N;
+    }
+
+    void destroy(Node *n) {
+        switch (n->kind) {
+        case N4: node_bytes_ -= sizeof(Node4); delete static_cast<Node4*>(n); break;
+        case N16: node_bytes_ -= sizeof(Node16); delete static_cast<Node16*>(n); break;
+        case N48: node_bytes_ -= sizeof(Node48); delete static_cast<Node48*>(n); break;
+        case N256: node_bytes_ -= sizeof(Node256); delete static_cast<Node256*>(n); break;
         }
     }
-    // Flush all cached buckets
-    for (const auto &b : lru) {
-        auto it = cache.find(b);
-        if (it != cache.end()) flush_bucket_to_disk(b, it->second);
+
+    void destroy_all(Ref r) {
+        if (!r) return;
+        if (is_leaf(r)) {
+            delete leaf(r);
+            return;
+        }
+        Node *n = node(r);
+        for (int pos = 0;;) {
+            Ref c = next_child(n, pos);
+            if (!c) break;
+            destroy_all(c);
+        }
+        delete n->term;
+        destroy(n);
+    }
+
+    static Ref *find_child(Node *n, uint8_t b) {
+        switch (n->kind) {
+        case N4: {
+            auto *x = static_cast<Node4*>(n);
+            for (int i = 0; i < n->count; ++i) {
+                if (x->keys[i] == b) return &x->child[i];
+            }
+            return nullptr;
+        }
+        case N16: {
+            auto *x = static_cast<Node16*>(n);
+#if defined(FILESTORE_X86) && defined(__SSE2__)
+            __m128i eq = _mm_cmpeq_epi8(_mm_set1_epi8((char)b), _mm_load_si128(reinterpret_cast<const __m128i*>(x->keys)));
+            unsigned mask = (unsigned)_mm_movemask_epi8(eq) & ((1u << n->count) - 1);
+            return mask ? &x->child[__builtin_ctz(mask)] : nullptr;
+#else
+            for (int i = 0; i < n->count; ++i) {
+                if (x->keys[i] == b) return &x->child[i];
+            }
+            return nullptr;
+#endif
+        }
+        case N48: {
+            auto *x = static_cast<Node48*>(n);
+            return x->index[b] ? &x->child[x->index[b] - 1] : nullptr;
+        }
+        case N256: {
+            auto *x = static_cast<Node256*>(n);
+            return x->child[b] ? &x->child[b] : nullptr;
+        }
+        }
+        return nullptr;
+    }
+
+    // In-order walk: the first child at or after position pos (array index for the small
+    // nodes, byte value for the large ones); pos moves past it. 0 when there is none.
+    static Ref next_child(Node *n, int &pos) {
+        switch (n->kind) {
+        case N4:
+            return pos < n->count ? static_cast<Node4*>(n)->child[pos++] : 0;
+        case N16:
+            return pos < n->count ? static_cast<Node16*>(n)->child[pos++] : 0;
+        case N48: {
+            auto *x = static_cast<Node48*>(n);
+            for (; pos < 256; ++pos) {
+                if (x->index[pos]) return x->child[x->index[pos++] - 1];
+            }
+            return 0;
+        }
+        case N256: {
+            auto *x = static_cast<Node256*>(n);
+            for (; pos < 256; ++pos) {
+                if (x->child[pos]) return x->child[pos++];
+            }
+            return 0;
+        }
+        }
+        return 0;
+    }
+
+    // Position just past child b, for resuming an in-order walk
+    static int child_pos(Node *n, uint8_t b) {
+        if (n->kind == N4) return (int)(key_index(static_cast<Node4*>(n)->keys, n->count, b) + 1);
+        if (n->kind == N16) return (int)(key_index(static_cast<Node16*>(n)->keys, n->count, b) + 1);
+        return b + 1;
+    }
+
+    static int key_index(const uint8_t *keys, int count, uint8_t b) {
+        int i = 0;
+        while (i < count && keys[i] != b) ++i;
+        return i;
+    }
+
+    template <class N>
+    static void insert_sorted(N *x, uint8_t b, Ref c) {
+        int i = x->count;
+        while (i > 0 && x->keys[i - 1] > b) {
+            x->keys[i] = x->keys[i - 1];
+            x->child[i] = x->child[i - 1];
+            --i;
+        }
+        x->keys[i] = b;
+        x->child[i] = c;
+        ++x->count;
+    }
+
+    template <class From, class To>
+    static To *take_header(From *x, To *y) {
+        y->prefix = std::move(x->prefix);
+        y->term = x->term;
+        return y;
+    }
+
+    // Adds child b -> c to the node in *slot, growing it into the next kind when full
+    void add_child(Ref *slot, uint8_t b, Ref c) {
+        Node *n = node(*slot);
+        if (n->kind == N4) {
+            auto *x = static_cast<Node4*>(n);
+            if (n->count < 4) return insert_sorted(x, b, c);
+            auto *y = take_header(x, make<Node16>());
+            memcpy(y->keys, x->keys, sizeof(x->keys));
+            memcpy(y->child, x->child, sizeof(x->child));
+            y->count = 4;
+            destroy(x);
+            *slot = ref(y);
+            return insert_sorted(y, b, c);
+        }
+        if (n->kind == N16) {
+            auto *x = static_cast<Node16*>(n);
+            if (n->count < 16) return insert_sorted(x, b, c);
+            auto *y = take_header(x, make<Node48>());
+            for (int i = 0; i < 16; ++i) {
+                y->child[i] = x->child[i];
+                y->index[x->keys[i]] = (uint8_t)(i + 1);
+            }
+            y->count = 16;
+            destroy(x);
+            *slot = ref(y);
+            n = y;
+        }
+        if (n->kind == N48) {
+            auto *x = static_cast<Node48*>(n);
+            if (n->count < 48) {
+                x->child[n->count] = c;
+                x->index[b] = (uint8_t)++n->count;
+                return;
+            }
+            auto *y = take_header(x, make<Node256>());
+            for (int k = 0; k < 256; ++k) {
+                if (x->index[k]) y->child[k] = x->child[x->index[k] - 1];
+            }
+            y->count = 48;
+            destroy(x);
+            *slot = ref(y);
+            n = y;
+        }
+        static_cast<Node256*>(n)->child[b] = c;
+        ++n->count;
+    }
+
+    void remove_child(Node *n, uint8_t b) {
+        if (n->kind == N4 || n->kind == N16) {
+            uint8_t *keys = n->kind == N4 ? static_cast<Node4*>(n)->keys : static_cast<Node16*>(n)->keys;
+            Ref *child = n->kind == N4 ? static_cast<Node4*>(n)->child : static_cast<Node16*>(n)->child;
+            int i = key_index(keys, n->count, b);
+            memmove(keys + i, keys + i + 1, n->count - i - 1);
+            memmove(child + i, child + i + 1, (n->count - i - 1) * sizeof(Ref));
+        } else if (n->kind == N48) {
+            auto *x = static_cast<Node48*>(n);
+            int slot = x->index[b] - 1, last = n->count - 1;
+            x->index[b] = 0;
+            if (slot != last) { // keep slots dense: move the last one into the hole
+                x->child[slot] = x->child[last];
+                for (int k = 0; k < 256; ++k) {
+                    if (x->index[k] == last + 1) {
+                        x->index[k] = (uint8_t)(slot + 1);
+                        break;
+                    }
+                }
+            }
+        } else {
+            static_cast<Node256*>(n)->child[b] = 0;
+        }
+        --n->count;
+    }
+
+    // After an erase below *slot: drop or merge a node left with too little, and move
+    // nodes down a size once they are well under their smaller neighbour's capacity
+    void normalize(Ref *slot) {
+        Node *n = node(*slot);
+        if (n->count == 0) {
+            *slot = n->term ? tag(n->term) : 0;
+            destroy(n);
+            return;
+        }
+        if (n->count == 1 && !n->term) {
+            int pos = 0;
+            Ref c = next_child(n, pos);
+            uint8_t b = first_key(n);
+            if (!is_leaf(c)) {
+                Node *cn = node(c);
+                cn->prefix.insert(0, 1, (char)b);
+                cn->prefix.insert(0, n->prefix);
+            }
+            *slot = c;
+            destroy(n);
+            return;
+        }
+        if (n->kind == N16 && n->count <= 3) {
+            auto *x = static_cast<Node16*>(n);
+            auto *y = take_header(x, make<Node4>());
+            memcpy(y->keys, x->keys, n->count);
+            memcpy(y->child, x->child, n->count * sizeof(Ref));
+            y->count = n->count;
+            destroy(x);
+            *slot = ref(y);
+        } else if (n->kind == N48 && n->count <= 12) {
+            auto *x = static_cast<Node48*>(n);
+            auto *y = take_header(x, make<Node16>());
+            for (int k = 0; k < 256; ++k) {
+                if (x->index[k]) insert_sorted(y, (uint8_t)k, x->child[x->index[k] - 1]);
+            }
+            destroy(x);
+            *slot = ref(y);
+        } else if (n->kind == N256 && n->count <= 37) {
+            auto *x = static_cast<Node256*>(n);
+            auto *y = take_header(x, make<Node48>());
+            for (int k = 0; k < 256; ++k) {
+                if (x->child[k]) {
+                    y->child[y->count] = x->child[k];
+                    y->index[k] = (uint8_t)++y->count;
+                }
+            }
+            destroy(x);
+            *slot = ref(y);
+        }
+    }
+
+    static uint8_t first_key(Node *n) {
+        switch (n->kind) {
+        case N4: return static_cast<Node4*>(n)->keys[0];
+        case N16: return static_cast<Node16*>(n)->keys[0];
+        case N48:
+            for (int k = 0;; ++k) {
+                if (static_cast<Node48*>(n)->index[k]) return (uint8_t)k;
+            }
+        case N256:
+            for (int k = 0;; ++k) {
+                if (static_cast<Node256*>(n)->child[k]) return (uint8_t)k;
+            }
+        }
+        return 0;
+    }
+
+    // Leaf for key, or nullptr
+    value_type *lookup(const string &key) const {
+        Ref r = root_;
+        size_t d = 0;
+        while (r) {
+            if (is_leaf(r)) return leaf(r)->first == key ? leaf(r) : nullptr;
+            Node *n = node(r);
+            if (key.compare(d, n->prefix.size(), n->prefix) != 0) return nullptr;
+            d += n->prefix.size();
+            if (d == key.size()) return n->term;
+            Ref *c = find_child(n, (uint8_t)key[d]);
+            if (!c) return nullptr;
+            r = *c;
+            ++d;
+        }
+        return nullptr;
+    }
+
+    template <class K>
+    pair<value_type*, bool> insert(K &&key) {
+        Ref *slot = &root_;
+        size_t d = 0;
+        for (;;) {
+            Ref r = *slot;
+            if (!r) {
+                auto *l = new value_type(std::forward<K>(key), V());
+                *slot = tag(l);
+                ++size_;
+                return {l, true};
+            }
+            if (is_leaf(r)) {
+                value_type *old = leaf(r);
+                const string &ok = old->first;
+                if (ok == key) return {old, false};
+                size_t i = d;
+                while (i < ok.size() && i < key.size() && ok[i] == key[i]) ++i;
+                auto *n = make<Node4>();
+                n->prefix.assign(key, d, i - d);
+                Ref nr = ref(n);
+                auto *l = new value_type(std::forward<K>(key), V());
+                const string &nk = l->first;
+                if (i == ok.size()) n->term = old;
+                else add_child(&nr, (uint8_t)ok[i], r);
+                if (i == nk.size()) n->term = l;
+                else add_child(&nr, (uint8_t)nk[i], tag(l));
+                *slot = nr;
+                ++size_;
+                return {l, true};
+            }
+            Node *n = node(r);
+            size_t p = 0, pl = n->prefix.size();
+            while (p < pl && d + p < key.size() && n->prefix[p] == key[d + p]) ++p;
+            if (p < pl) { // the key leaves the compressed path: split it
+                auto *m = make<Node4>();
+                m->prefix.assign(n->prefix, 0, p);
+                uint8_t nb = (uint8_t)n->prefix[p];
+                n->prefix.erase(0, p + 1);
+                Ref mr = ref(m);
+                add_child(&mr, nb, r);
+                auto *l = new value_type(std::forward<K>(key), V());
+                if (d + p == l->first.size()) m->term = l;
+                else add_child(&mr, (uint8_t)l->first[d + p], tag(l));
+                *slot = mr;
+                ++size_;
+                return {l, true};
+            }
+            d += pl;
+            if (d == key.size()) {
+                if (n->term) return {n->term, false};
+                n->term = new value_type(std::forward<K>(key), V());
+                ++size_;
+                return {n->term, true};
+            }
+            Ref *c = find_child(n, (uint8_t)key[d]);
+            if (!c) {
+                uint8_t b = (uint8_t)key[d];
+                auto *l = new value_type(std::forward<K>(key), V());
+                add_child(slot, b, tag(l));
+                ++size_;
+                return {l, true};
+            }
+            slot = c;
+            ++d;
+        }
+    }
+
+    bool erase_at(Ref *slot, const string &key, size_t d) {
+        Ref r = *slot;
+        if (!r) return false;
+        if (is_leaf(r)) {
+            if (leaf(r)->first != key) return false;
+            delete leaf(r);
+            *slot = 0;
+            return true;
+        }
+        Node *n = node(r);
+        if (key.compare(d, n->prefix.size(), n->prefix) != 0) return false;
+        d += n->prefix.size();
+        if (d == key.size()) {
+            if (!n->term) return false;
+            delete n->term;
+            n->term = nullptr;
+        } else {
+            uint8_t b = (uint8_t)key[d]; // key may be the erased leaf's own string
+            Ref *c = find_child(n, b);
+            if (!c || !erase_at(c, key, d + 1)) return false;
+            if (!*c) remove_child(n, b);
+        }
+        normalize(slot);
+        return true;
+    }
+
+public:
+    // Ordered iterator: a stack of (inner node, resume position) down to the current leaf.
+    // Iterators from find() carry no stack (lookups stay allocation-free); incrementing
+    // one rebuilds it from the key.
+    class iterator {
+        friend class ArtMap;
+        const ArtMap *map_ = nullptr;
+        value_type *cur_ = nullptr;
+        vector<pair<Node*, int>> stack_;
+        bool walked_ = false;
+
+        // Descends from r to the first leaf in order
+        void descend(Ref r) {
+            while (!is_leaf(r)) {
+                Node *n = node(r);
+                if (n->term) {
+                    stack_.push_back({n, 0});
+                    cur_ = n->term;
+                    return;
+                }
+                int pos = 0;
+                Ref c = next_child(n, pos);
+                stack_.push_back({n, pos});
+                r = c;
+            }
+            cur_ = leaf(r);
+        }
+
+        void advance() {
+            while (!stack_.empty()) {
+                auto &top = stack_.back();
+                Ref c = next_child(top.first, top.second);
+                if (c) {
+                    if (is_leaf(c)) {
+                        cur_ = leaf(c);
+                    } else {
+                        cur_ = nullptr;
+                        descend(c);
+                    }
+                    return;
+                }
+                stack_.pop_back();
+            }
+            cur_ = nullptr;
+        }
+
+        // Stack for an existing key, positioned just past it
+        void seek(const string &key) {
+            stack_.clear();
+            Ref r = map_->root_;
+            size_t d = 0;
+            while (!is_leaf(r)) {
+                Node *n = node(r);
+                d += n->prefix.size();
+                if (d == key.size()) {
+                    stack_.push_back({n, 0});
+                    return;
+                }
+                uint8_t b = (uint8_t)key[d++];
+                stack_.push_back({n, child_pos(n, b)});
+                r = *find_child(n, b);
+            }
+        }
+
+    public:
+        iterator() = default;
+        iterator(const ArtMap *m, value_type *cur) : map_(m), cur_(cur) {}
+        value_type &operator*() const { return *cur_; }
+        value_type *operator->() const { return cur_; }
+        iterator &operator++() {
+            if (!walked_) {
+                seek(cur_->first);
+                walked_ = true;
+            }
+            advance();
+            return *this;
+        }
+        bool operator==(const iterator &o) const { return cur_ == o.cur_; }
+        bool operator!=(const iterator &o) const { return cur_ != o.cur_; }
+    };
+    using const_iterator = iterator;
+
+    ArtMap() = default;
+    ArtMap(const ArtMap &) = delete;
+    ArtMap &operator=(const ArtMap &) = delete;
+    ArtMap(ArtMap &&o) noexcept : root_(o.root_), size_(o.size_), node_bytes_(o.node_bytes_) {
+        o.root_ = 0;
+        o.size_ = o.node_bytes_ = 0;
+    }
+    ArtMap &operator=(ArtMap &&o) noexcept {
+        if (this != &o) {
+            clear();
+            swap(root_, o.root_);
+            swap(size_, o.size_);
+            swap(node_bytes_, o.node_bytes_);
+        }
+        return *this;
+    }
+    ~ArtMap() { clear(); }
+
+    iterator begin() const {
+        iterator it(this, nullptr);
+        it.walked_ = true;
+        if (root_) it.descend(root_);
+        return it;
+    }
+    iterator end() const { return iterator(this, nullptr); }
+    iterator find(const string &key) const { return iterator(this, lookup(key)); }
+    V &operator[](const string &key) { return insert(key).first->second; }
+
+    template <class K, class W>
+    pair<iterator, bool> emplace(K &&key, W &&val) {
+        auto [l, inserted] = insert(std::forward<K>(key));
+        if (inserted) l->second = std::forward<W>(val);
+        return {iterator(this, l), inserted};
+    }
+
+    size_t erase(const string &key) {
+        if (!erase_at(&root_, key, 0)) return 0;
+        --size_;
+        return 1;
+    }
+
+    // Erases *it and returns the next key's iterator (found again: the erase may reshape
+    // the nodes the old stack points into)
+    iterator erase(iterator it) {
+        iterator next = it;
+        ++next;
+        if (next == end()) {
+            erase(it->first);
+            return end();
+        }
+        string after = next->first;
+        erase(it->first);
+        return iterator(this, lookup(after));
+    }
+
+    void clear() {
+        destroy_all(root_);
+        root_ = 0;
+        size_ = 0;
+    }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    void reserve(size_t) {}
+    size_t node_bytes() const { return node_bytes_; } // inner nodes, for memory estimates
+};
+
+using BucketIndex = ArtMap<Postings>;
+#else
+using BucketIndex = unordered_map<string, Postings>;
+#endif
+
+struct Bucket {
+    // index -> sorted unique values
+    BucketIndex map;
+    bool dirty = false;
+    // Mutations since load as encoded journal entries, appended to the file at flush time;
+    // one reused buffer, so queueing a mutation does not allocate once it has grown
+    string pending;
+    uint32_t pending_ops = 0;
+    bool pending_overflow = false;
+    uint64_t base_bytes = 0;    // 0 = no BK2 image on disk (missing, BK1 or text)
+    uint64_t journal_bytes = 0; // valid journal bytes following the base image
+    bool varint_klen = false;   // on-disk image uses varint key lengths (journal must match)
+    unordered_map<string, uint32_t> expiry; // keys with a TTL -> unix deadline
+    bool shards = false;        // holds shard directories (sharded hot keys)
+    string moved_from;          // stale copy outside the ring directory, removed after rewrite
+};
+
+static uint32_t now_seconds() {
+    return (uint32_t)time(nullptr);
+}
+
+static bool key_expired(const Bucket &bk, const string &idx) {
+    if (bk.expiry.empty()) return false;
+    auto it = bk.expiry.find(idx);
+    return it != bk.expiry.end() && it->second <= now_seconds();
+}
+
+// Fallback text parser: index\tcount\tval1 val2 ... (values are already sorted unique)
+static bool parse_line_fast(const string &line, string &index_out, vector<int> &vals_out) {
+    size_t p1 = line.find('\t');
+    if (p1 == string::npos) return false;
+    size_t p2 = line.find('\t', p1 + 1);
+    if (p2 == string::npos) return false;
+    index_out.assign(line.data(), p1);
+    vals_out.clear();
+    const char *s = line.c_str() + p2 + 1;
+    char *endptr = nullptr;
+    while (*s) {
+        while (*s == ' ') ++s;
+        if (!*s) break;
+        long v = strtol(s, &endptr, 10);
+        if (s == endptr) break;
+        vals_out.push_back((int)v);
+        s = endptr;
+    }
+    return true;
+}
+
+// Latency histograms (--latency): one per operation kind, log-linear like HdrHistogram.
+// Values (ns) below 64 get exact buckets; above, each power of two is split into 32
+// linear sub-buckets (<= 3.2% error). Counters are relaxed atomics because the exit-time
+// flush runs one thread per data directory.
+enum LatencyKind {
+    LAT_INSERT, LAT_DELETE, LAT_FIND, LAT_EXPIRE, LAT_SET_QUERY,
+    LAT_LOAD_MISS, LAT_FLUSH_APPEND, LAT_FLUSH_REWRITE, LAT_KINDS
+};
+static const char *LAT_NAMES[LAT_KINDS] = {
+    "insert", "delete", "find", "expire", "set-query", "load-miss", "flush-append", "flush-rewrite"
+};
+static const int HIST_SUB_BITS = 5;
+static const size_t HIST_BUCKETS = (64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS;
+
+struct LatencyHist {
+    atomic<uint64_t> counts[HIST_BUCKETS];
+    atomic<uint64_t> total, sum, peak;
+
+    static size_t index(uint64_t v) {
+        if (v < (2u << HIST_SUB_BITS)) return (size_t)v;
+        int e = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+        return ((size_t)e << HIST_SUB_BITS) + (size_t)(v >> e);
+    }
+    // smallest value recorded into bucket i
+    static uint64_t lowest(size_t i) {
+        if (i < (2u << HIST_SUB_BITS)) return i;
+        size_t e = (i >> HIST_SUB_BITS) - 1;
+        return (uint64_t)((i & ((1u << HIST_SUB_BITS) - 1)) + (1u << HIST_SUB_BITS)) << e;
+    }
+    void record(uint64_t ns) {
+        counts[index(ns)].fetch_add(1, memory_order_relaxed);
+        total.fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(ns, memory_order_relaxed);
+        uint64_t m = peak.load(memory_order_relaxed);
+        while (ns > m && !peak.compare_exchange_weak(m, ns, memory_order_relaxed)) {}
+    }
+    // highest value equivalent to the q-quantile's bucket
+    uint64_t percentile(double q) const {
+        uint64_t n = total.load(memory_order_relaxed);
+        uint64_t rank = max<uint64_t>(1, (uint64_t)ceil(q * (double)n)), seen = 0;
+        for (size_t i = 0; i + 1 < HIST_BUCKETS; ++i) {
+            seen += counts[i].load(memory_order_relaxed);
+            if (seen >= rank) return min(lowest(i + 1) - 1, peak.load(memory_order_relaxed));
+        }
+        return peak.load(memory_order_relaxed);
+    }
+};
+
+// Engine counters behind --metrics. Command and cache counters are main-thread only;
+// I/O and flush counters are also bumped by the per-directory flush/rebalance threads.
+struct EngineCounters {
+    uint64_t events[LAT_KINDS] = {}; // timed main-thread events: commands and load misses
+    uint64_t cache_hits = 0;
+    uint64_t evictions = 0;
+    atomic<uint64_t> bytes_read{0}, bytes_written{0};
+    atomic<uint64_t> flush_appends{0}, flush_rewrites{0};
+};
+
+static EngineCounters counters;
+static LatencyHist *lat_hist = nullptr; // allocated by --latency
+static volatile sig_atomic_t lat_dump_requested = 0;
+
+static uint64_t lat_now() {
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Tracing (--trace FILE): spans land in a per-thread ring of complete events (Chrome
+// phase "X": begin timestamp plus duration, so overwriting the oldest slot never orphans
+// a begin or an end) and are written as trace-event JSON at exit for Perfetto or
+// chrome://tracing. A ring keeps the newest TRACE_RING spans of its thread.
+static const size_t TRACE_RING = 1 << 15;
+
+struct TraceEvent {
+    const char *name;
+    uint64_t start, dur;
+};
+
+struct TraceRing {
+    int tid;
+    vector<TraceEvent> events;
+    uint64_t next = 0;
+};
+
+static bool trace_on = false;
+static uint64_t trace_epoch = 0;
+static mutex trace_mu;
+static vector<unique_ptr<TraceRing>> trace_rings; // outlive their threads until the dump
+static thread_local TraceRing *trace_ring = nullptr;
+
+static void trace_complete(const char *name, uint64_t start, uint64_t end) {
+    if (!trace_ring) {
+        lock_guard<mutex> lock(trace_mu);
+        trace_rings.emplace_back(new TraceRing{(int)trace_rings.size() + 1, vector<TraceEvent>(TRACE_RING)});
+        trace_ring = trace_rings.back().get();
+    }
+    trace_ring->events[trace_ring->next++ % TRACE_RING] = {name, start, end - start};
+}
+
+// Traces its scope as `name` (a string literal); one branch when tracing is off
+struct TraceSpan {
+    const char *name;
+    uint64_t t0;
+    explicit TraceSpan(const char *n) : name(n), t0(trace_on ? lat_now() : 0) {}
+    ~TraceSpan() {
+        if (trace_on) trace_complete(name, t0, lat_now());
+    }
+};
+
+static void write_trace(string path) {
+    if (opt.worker) path += "." + to_string(opt.worker_index);
+    FILE *fp = fopen(path.c_str(), "w");
+    if (!fp) return;
+    lock_guard<mutex> lock(trace_mu);
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    const char *sep = "\n";
+    for (const auto &ring : trace_rings) {
+        uint64_t first = ring->next > TRACE_RING ? ring->next - TRACE_RING : 0;
+        for (uint64_t i = first; i < ring->next; ++i) {
+            const TraceEvent &e = ring->events[i % TRACE_RING];
+            fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}", sep,
+                    e.name, (double)(e.start - trace_epoch) / 1e3, (double)e.dur / 1e3, (int)getpid(), ring->tid);
+            sep = ",\n";
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
+
+// Counts an event and times its scope into lat_hist[kind] and the trace; costs a branch
+// when neither --latency nor --trace is on
+struct LatencyTimer {
+    int kind;
+    uint64_t t0;
+    explicit LatencyTimer(int k) : kind(k), t0(lat_hist || trace_on ? lat_now() : 0) { ++counters.events[k]; }
+    ~LatencyTimer() {
+        if (!lat_hist && !trace_on) return;
+        uint64_t now = lat_now();
+        if (lat_hist) lat_hist[kind].record(now - t0);
+        if (trace_on) trace_complete(LAT_NAMES[kind], t0, now);
+    }
+};
+
+static void print_latency() {
+    if (!lat_hist) return;
+    static const double QS[] = {0.5, 0.9, 0.99, 0.999, 0.9999};
+    fprintf(stderr, "%-14s %10s %9s %9s %9s %9s %9s %9s %9s\n", "latency (us)", "count", "mean",
+            "p50", "p90", "p99", "p99.9", "p99.99", "max");
+    for (int k = 0; k < LAT_KINDS; ++k) {
+        const LatencyHist &h = lat_hist[k];
+        uint64_t n = h.total.load(memory_order_relaxed);
+        if (!n) continue;
+        fprintf(stderr, "%-14s %10llu %9.2f", LAT_NAMES[k], (unsigned long long)n,
+                (double)h.sum.load(memory_order_relaxed) / (double)n / 1e3);
+        for (double q : QS) fprintf(stderr, " %9.2f", (double)h.percentile(q) / 1e3);
+        fprintf(stderr, " %9.2f\n", (double)h.peak.load(memory_order_relaxed) / 1e3);
+    }
+}
+
+// LRU cache: bucket id -> Bucket
+static unordered_map<int, Bucket> cache;
+static list<int> lru; // front = most recent, back = least recent
+static unordered_map<int, list<int>::iterator> where;
+
+static void touch_lru(int b) {
+    auto it = where.find(b);
+    if (it != where.end()) {
+        lru.splice(lru.begin(), lru, it->second); // relinks the node: no allocation
+    } else {
+        lru.push_front(b);
+        where[b] = lru.begin();
+    }
+}
+
+static bool read_file(const string &path, string &buf) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    buf.clear();
+    char chunk[1 << 15];
+    size_t got;
+    while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0) buf.append(chunk, got);
+    fclose(f);
+    counters.bytes_read.fetch_add(buf.size(), memory_order_relaxed);
+    return true;
+}
+
+static bool postings_insert(Postings &vec, int val) {
+    size_t pos = kern.lower_bound(vec.data(), vec.size(), val);
+    if (pos < vec.size() && vec[pos] == val) return false;
+    if (vec.size() == vec.capacity()) vec.reserve(posting_capacity(vec.size() + 1)); // next class, not 2x
+    vec.insert(vec.begin() + pos, val);
+    return true;
+}
+
+static bool postings_erase(Postings &vec, int val) {
+    auto it = vec.begin() + kern.lower_bound(vec.data(), vec.size(), val);
+    if (it == vec.end() || *it != val) return false;
+    vec.erase(it);
+    return true;
+}
+
+// Hot-key sharding: a posting list that grows past SHARD_SPLIT values is split into
+// value-range shards, so an insert or delete moves at most SHARD_SPLIT values. Each
+// shard is its own record <key> SHARD_SEP <lower bound> holding the values from its
+// bound up to the next one; the directory record <key> SHARD_SEP holds the ascending
+// bounds, the first being INT_MIN. A full shard splits at its median; a shard that
+// empties, or that fits with a neighbour in SHARD_MERGE values, merges into it, and a
+// key back down to one shard becomes a plain record again.
+static const size_t SHARD_SPLIT = 4096;
+static const size_t SHARD_MERGE = SHARD_SPLIT / 4;
+
+// Record names are built in a per-thread buffer: buckets are also read (and checked by
+// check_shards) on the prewarm and --rebalance reader threads
+static string &shard_name(const string &idx) {
+    thread_local string name;
+    name.assign(idx);
+    name.push_back(SHARD_SEP);
+    return name;
+}
+
+static const string &shard_dir_key(const string &idx) {
+    return shard_name(idx);
+}
+
+static const string &shard_key(const string &idx, int bound) {
+    char num[12];
+    auto res = to_chars(num, num + sizeof(num), bound);
+    string &name = shard_name(idx);
+    name.append(num, res.ptr - num);
+    return name;
+}
+
+static Postings *shard_dir(Bucket &bk, const string &idx) {
+    if (!bk.shards) return nullptr;
+    auto it = bk.map.find(shard_dir_key(idx));
+    return it == bk.map.end() ? nullptr : &it->second;
+}
+
+// A shard missing from a damaged file reads as empty (check_shards folds such keys on load)
+static Postings &shard_at(Bucket &bk, const string &idx, int bound) {
+    return bk.map[shard_key(idx, bound)];
+}
+
+static size_t shard_index(const Postings &dir, int val) {
+    size_t i = (size_t)(upper_bound(dir.begin(), dir.end(), val) - dir.begin());
+    return i ? i - 1 : 0;
+}
+
+static void split_shard(Bucket &bk, const string &idx, Postings &dir, size_t i) {
+    Postings &lo = shard_at(bk, idx, dir[i]);
+    size_t half = lo.size() / 2;
+    int bound = lo[half];
+    Postings hi;
+    hi.reserve(posting_capacity(lo.size() - half));
+    hi.assign(lo.begin() + half, lo.end());
+    lo.resize(half); // the spare capacity goes at the next full rewrite
+    bk.map.emplace(shard_key(idx, bound), std::move(hi));
+    dir.insert(dir.begin() + i + 1, bound);
+}
+
+// Turns the plain record of idx into a directory and two shards
+static void shard_postings(Bucket &bk, const string &idx) {
+    auto it = bk.map.find(idx);
+    Postings vals = std::move(it->second);
+    bk.map.erase(it);
+    bk.map.emplace(shard_key(idx, INT_MIN), std::move(vals));
+    Postings &dir = bk.map[shard_dir_key(idx)];
+    dir.assign(1, INT_MIN);
+    bk.shards = true;
+    split_shard(bk, idx, dir, 0);
+}
+
+// Appends shard i + 1 to shard i; a key left with one shard is unsharded
+static void merge_shards(Bucket &bk, const string &idx, Postings &dir, size_t i) {
+    Postings &lo = shard_at(bk, idx, dir[i]);
+    Postings &hi = shard_at(bk, idx, dir[i + 1]);
+    if (lo.size() + hi.size() > lo.capacity()) lo.reserve(posting_capacity(lo.size() + hi.size()));
+    lo.insert(lo.end(), hi.begin(), hi.end());
+    bk.map.erase(shard_key(idx, dir[i + 1]));
+    dir.erase(dir.begin() + i + 1);
+    if (dir.size() > 1) return;
+    Postings vals = std::move(lo);
+    bk.map.erase(shard_key(idx, INT_MIN));
+    bk.map.erase(shard_dir_key(idx));
+    bk.map.emplace(idx, std::move(vals));
+}
+
+static bool shard_insert(Bucket &bk, const string &idx, Postings &dir, int val) {
+    size_t i = shard_index(dir, val);
+    Postings &vec = shard_at(bk, idx, dir[i]);
+    if (!postings_insert(vec, val)) return false;
+    if (vec.size() > SHARD_SPLIT) split_shard(bk, idx, dir, i);
+    return true;
+}
+
+static bool shard_erase(Bucket &bk, const string &idx, Postings &dir, int val) {
+    size_t i = shard_index(dir, val);
+    Postings &vec = shard_at(bk, idx, dir[i]);
+    if (!postings_erase(vec, val)) return false;
+    size_t n = vec.size();
+    if (i > 0 && (n == 0 || n + shard_at(bk, idx, dir[i - 1]).size() <= SHARD_MERGE)) {
+        merge_shards(bk, idx, dir, i - 1);
+    } else if (i + 1 < dir.size() && n + shard_at(bk, idx, dir[i + 1]).size() <= SHARD_MERGE) {
+        merge_shards(bk, idx, dir, i);
+    }
+    return true;
+}
+
+// Appends every value of a sharded key, in order
+static void shard_values(Bucket &bk, const string &idx, const Postings &dir, vector<int> &dst) {
+    for (int bound : dir) {
+        const Postings &vec = shard_at(bk, idx, bound);
+        dst.insert(dst.end(), vec.begin(), vec.end());
+    }
+}
+
+// Why the records of sharded key idx are inconsistent, or nullptr: the directory must
+// start at INT_MIN with ascending bounds, each bound needs its shard record holding only
+// values in its range, no shard record may be unlisted, and no plain record may coexist
+static const char *shard_problem(Bucket &bk, const string &idx, size_t records) {
+    auto it = bk.map.find(shard_dir_key(idx));
+    if (it == bk.map.end()) return "shard records without a directory";
+    if (bk.map.find(idx) != bk.map.end()) return "both a plain record and shards";
+    const Postings &dir = it->second;
+    if (dir.empty() || dir[0] != INT_MIN) return "directory does not start at INT_MIN";
+    if (adjacent_find(dir.begin(), dir.end(), greater_equal<int>()) != dir.end()) return "directory bounds out of order";
+    if (records != dir.size()) return records < dir.size() ? "shard record missing" : "shard record not in the directory";
+    for (size_t i = 0; i < dir.size(); ++i) {
+        auto sh = bk.map.find(shard_key(idx, dir[i]));
+        if (sh == bk.map.end()) return "shard record not in the directory";
+        const Postings &vals = sh->second;
+        if (!vals.empty() && (vals.front() < dir[i] || (i + 1 < dir.size() && vals.back() >= dir[i + 1]))) {
+            return "shard values outside its range";
+        }
+    }
+    return nullptr;
+}
+
+// Replaces every record of idx (plain, directory, shards) with one plain record
+static void fold_shards(Bucket &bk, const string &idx) {
+    Postings vals;
+    vector<string> names;
+    for (const auto &kv : bk.map) {
+        if (logical_len(kv.first) != idx.size() || kv.first.compare(0, idx.size(), idx) != 0) continue;
+        names.push_back(kv.first);
+        if (!is_shard_dir(kv.first)) vals.insert(vals.end(), kv.second.begin(), kv.second.end());
+    }
+    for (const string &name : names) bk.map.erase(name);
+    sort(vals.begin(), vals.end());
+    vals.erase(unique(vals.begin(), vals.end()), vals.end());
+    bk.map.emplace(idx, std::move(vals));
+}
+
+// Checks the sharded keys of a freshly read bucket and folds inconsistent ones, so the
+// shard routines never meet a damaged layout; returns (key, problem) per folded key
+static vector<pair<string, const char*>> check_shards(Bucket &bk) {
+    vector<pair<string, const char*>> folded;
+    map<string, size_t> shards; // logical key -> shard records (directory excluded)
+    for (const auto &kv : bk.map) {
+        size_t len = logical_len(kv.first);
+        if (len < kv.first.size()) shards[kv.first.substr(0, len)] += !is_shard_dir(kv.first);
+    }
+    for (const auto &ks : shards) {
+        if (const char *why = shard_problem(bk, ks.first, ks.second)) {
+            fold_shards(bk, ks.first);
+            folded.emplace_back(ks.first, why);
+        }
+    }
+    return folded;
+}
+
+static bool bucket_insert(Bucket &bk, const string &idx, int val) {
+    if (Postings *dir = shard_dir(bk, idx)) return shard_insert(bk, idx, *dir, val);
+    auto &vec = bk.map[idx]; // creates empty if not exists
+    if (!postings_insert(vec, val)) return false;
+    if (vec.size() > SHARD_SPLIT) shard_postings(bk, idx);
+    return true;
+}
+
+static bool bucket_erase(Bucket &bk, const string &idx, int val) {
+    if (Postings *dir = shard_dir(bk, idx)) return shard_erase(bk, idx, *dir, val);
+    auto itIdx = bk.map.find(idx);
+    if (itIdx == bk.map.end()) return false;
+    return postings_erase(itIdx->second, val);
+}
+
+// Removes idx with all its values, sharded or not
+static bool bucket_drop(Bucket &bk, const string &idx) {
+    if (Postings *dir = shard_dir(bk, idx)) {
+        for (int bound : *dir) bk.map.erase(shard_key(idx, bound));
+        bk.map.erase(shard_dir_key(idx));
+        return true;
+    }
+    return bk.map.erase(idx) > 0;
+}
+
+// LZ block codec, LZ4-style sequences:
+// [token: min(lit,15)<<4 | min(match-4,15)][lit ext bytes][literals][u16 offset][match ext bytes]
+// Length extensions are runs of 255 plus a final byte; the last sequence carries literals only.
+static const size_t LZ_MIN_MATCH = 4;
+static const int LZ_HASH_BITS = 12;
+
+static void lz_put_len(string &dst, size_t len) {
+    while (len >= 255) { dst.push_back((char)255); len -= 255; }
+    dst.push_back((char)len);
+}
+
+static void lz_emit(string &dst, const char *lit, size_t nlit, size_t off, size_t mlen) {
+    size_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    dst.push_back((char)((min<size_t>(nlit, 15) << 4) | min<size_t>(ml, 15)));
+    if (nlit >= 15) lz_put_len(dst, nlit - 15);
+    dst.append(lit, nlit);
+    if (!mlen) return;
+    dst.push_back((char)(off & 0xFF));
+    dst.push_back((char)(off >> 8));
+    if (ml >= 15) lz_put_len(dst, ml - 15);
+}
+
+static void lz_compress(const char *src, size_t n, string &dst) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    fill(table, table + (1 << LZ_HASH_BITS), UINT32_MAX);
+    size_t anchor = 0, i = 0;
+    while (i + LZ_MIN_MATCH <= n) {
+        uint32_t seq;
+        memcpy(&seq, src + i, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        uint32_t cand = table[h];
+        table[h] = (uint32_t)i;
+        if (cand == UINT32_MAX || i - cand > 65535 || memcmp(src + cand, src + i, 4) != 0) {
+            ++i;
+            continue;
+        }
+        size_t m = LZ_MIN_MATCH;
+        while (i + m < n && src[cand + m] == src[i + m]) ++m;
+        lz_emit(dst, src + anchor, i - anchor, i - cand, m);
+        i += m;
+        anchor = i;
+    }
+    lz_emit(dst, src + anchor, n - anchor, 0, 0);
+}
+
+// Upper bound on the decoded size of an n-byte block (a length extension byte adds at
+// most 255 bytes), checked before allocating for a size read from a file header
+static uint64_t lz_max_raw(size_t n) {
+    return (uint64_t)n * 256 + 64;
+}
+
+static bool lz_decompress(const char *src, size_t n, char *dst, size_t raw) {
+    const unsigned char *ip = reinterpret_cast<const unsigned char*>(src), *iend = ip + n;
+    size_t op = 0;
+    auto get_len = [&](size_t &len) {
+        unsigned char c;
+        do {
+            if (ip == iend) return false;
+            c = *ip++;
+            len += c;
+        } while (c == 255);
+        return true;
+    };
+    while (ip < iend) {
+        unsigned tok = *ip++;
+        size_t lit = tok >> 4;
+        if (lit == 15 && !get_len(lit)) return false;
+        if ((size_t)(iend - ip) < lit || raw - op < lit) return false;
+        memcpy(dst + op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend) break;
+        if (iend - ip < 2) return false;
+        size_t off = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t ml = tok & 15;
+        if (ml == 15 && !get_len(ml)) return false;
+        ml += LZ_MIN_MATCH;
+        if (off == 0 || off > op || raw - op < ml) return false;
+        for (size_t k = 0; k < ml; ++k) dst[op + k] = dst[op - off + k]; // overlapping copy
+        op += ml;
+    }
+    return op == raw;
+}
+
+static const unsigned char BK_FLAG_VARINT_KLEN = 1;
+static const unsigned char BK_FLAG_TTL = 2; // requires BK_FLAG_VARINT_KLEN
+
+static void put_varint(string &img, uint32_t v) {
+    while (v >= 0x80) { img.push_back((char)(v | 0x80)); v >>= 7; }
+    img.push_back((char)v);
+}
+
+static bool get_varint(const char *&p, const char *end, uint32_t &v) {
+    if (p < end && (unsigned char)*p < 0x80) { // one-byte fast path
+        v = (unsigned char)*p++;
+        return true;
+    }
+    v = 0;
+    for (int shift = 0; shift <= 28; shift += 7) {
+        if (p == end) return false;
+        unsigned char c = (unsigned char)*p++;
+        v |= (uint32_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) return true;
+    }
+    return false;
+}
+
+static bool get_klen(const char *&p, const char *end, bool varint_klen, uint32_t &klen) {
+    if (varint_klen) return get_varint(p, end, klen);
+    if (p == end) return false;
+    klen = (unsigned char)*p++;
+    return true;
+}
+
+// Binary load/flush
+// Parses [klen][key][u32 deadline if TTL][u32 cnt][vals] records in [p, end); false on a
+// truncated record. delta: value lists are LEB128 varints of successive differences (BK3).
+static bool parse_records(const char *p, const char *end, Bucket &bk, unsigned char flags, bool delta = false) {
+    bool ttl = flags & BK_FLAG_TTL;
+    while (p < end) {
+        uint32_t klen;
+        if (!get_klen(p, end, flags & BK_FLAG_VARINT_KLEN, klen)) return false;
+        bool has_ttl = ttl && (klen & 1);
+        if (ttl) klen >>= 1;
+        if ((size_t)(end - p) < (size_t)klen + 4 + (has_ttl ? 4 : 0)) return false;
+        string key(p, klen);
+        p += klen;
+        if (is_shard_dir(key)) bk.shards = true;
+        if (has_ttl) {
+            uint32_t deadline;
+            memcpy(&deadline, p, 4);
+            p += 4;
+            bk.expiry.emplace(logical_key(key), deadline);
+        }
+        uint32_t cnt;
+        memcpy(&cnt, p, 4);
+        p += 4;
+        if (delta) {
+            if ((size_t)(end - p) < cnt) return false; // at least one byte per value
+            Postings vals;
+            vals.reserve(posting_capacity(cnt));
+            vals.resize(cnt);
+            uint32_t prev = 0;
+            for (uint32_t i = 0; i < cnt; ++i) {
+                uint32_t d;
+                if (!get_varint(p, end, d)) return false;
+                prev += d;
+                vals[i] = (int)prev;
+            }
+            bk.map.emplace(std::move(key), std::move(vals));
+            continue;
+        }
+        if ((size_t)(end - p) / sizeof(int) < cnt) return false;
+        Postings vals;
+        vals.reserve(posting_capacity(cnt));
+        vals.resize(cnt);
+        if (cnt) memcpy(vals.data(), p, cnt * sizeof(int));
+        p += cnt * sizeof(int);
+        bk.map.emplace(std::move(key), std::move(vals));
+    }
+    return true;
+}
+
+// Log entry ops: 'I' insert, 'D' delete, 'E' set deadline (val, 0 clears), 'X' drop key.
+// Returns whether the bucket changed.
+static bool apply_log_entry(Bucket &bk, char op, const string &key, int val) {
+    if (op == 'I') return bucket_insert(bk, key, val);
+    if (op == 'D') return bucket_erase(bk, key, val);
+    if (op == 'X') {
+        bool had = bk.expiry.erase(key) > 0;
+        return bucket_drop(bk, key) || had;
+    }
+    if (val) {
+        bk.expiry[key] = (uint32_t)val;
+        return true;
+    }
+    return bk.expiry.erase(key) > 0;
+}
+
+static void put_log_entry(string &rec, char op, const string &key, int val) {
+    rec.push_back(op);
+    put_varint(rec, (uint32_t)key.size());
+    rec.append(key);
+    rec.append(reinterpret_cast<const char*>(&val), 4);
+}
+
+// Replays journal entries; stops quietly at a torn tail and returns the bytes applied
+static size_t replay_journal(const char *p, const char *end, Bucket &bk) {
+    const char *start = p;
+    string key;
+    while (p < end) {
+        const char *q = p;
+        char op = *q++;
+        uint32_t klen;
+        if ((op != 'I' && op != 'D' && op != 'E' && op != 'X') || !get_klen(q, end, bk.varint_klen, klen)) break;
+        if ((size_t)(end - q) < (size_t)klen + 4) break;
+        key.assign(q, klen);
+        int val;
+        memcpy(&val, q + klen, 4);
+        apply_log_entry(bk, op, key, val);
+        p = q + klen + 4;
+    }
+    return (size_t)(p - start);
+}
+
+static bool load_bucket_binary_file(const string &path, Bucket &bk) {
+    TraceSpan span("load_bucket_binary_file");
+    string buf;
+    if (!read_file(path, buf)) return true; // empty is ok
+    if (buf.size() < 4 || buf[0] != 'B' || buf[1] != 'K') return false;
+    unsigned char flags = (unsigned char)buf[3];
+    if (flags & ~(BK_FLAG_VARINT_KLEN | BK_FLAG_TTL)) return false;
+    if ((flags & BK_FLAG_TTL) && !(flags & BK_FLAG_VARINT_KLEN)) return false;
+    bk.varint_klen = flags & BK_FLAG_VARINT_KLEN;
+    const char *p = buf.data(), *end = p + buf.size();
+    bk.map.reserve(1024);
+    if (buf[2] == '1') return !flags && parse_records(p + 4, end, bk, 0);
+    if ((buf[2] != '2' && buf[2] != '3') || buf.size() < 8) return false;
+    uint32_t base;
+    memcpy(&base, p + 4, 4);
+    if (base < 8 || base > buf.size()) return false;
+    if (buf[2] == '3') {
+        uint32_t raw_bytes;
+        if (base < 12) return false;
+        memcpy(&raw_bytes, p + 8, 4);
+        if (raw_bytes > lz_max_raw(base - 12)) return false;
+        string raw(raw_bytes, '\0');
+        if (!lz_decompress(p + 12, base - 12, &raw[0], raw_bytes)) return false;
+        if (!parse_records(raw.data(), raw.data() + raw.size(), bk, flags, true)) return false;
+    } else if (!parse_records(p + 8, p + base, bk, flags)) {
+        return false;
+    }
+    if (bk.shards) check_shards(bk);
+    bk.base_bytes = base;
+    bk.journal_bytes = replay_journal(p + base, end, bk);
+    return true;
+}
+
+static bool load_bucket_text_file(const string &path, Bucket &bk) {
+    ifstream fin(path);
+    if (!fin.good()) return true; // treat as empty
+    string line, idx;
+    vector<int> vals;
+    bk.map.reserve(1024);
+    while (getline(fin, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!parse_line_fast(line, idx, vals)) continue;
+        bk.map.emplace(idx, Postings(vals.begin(), vals.end()));
+    }
+    return true;
+}
+
+static void put_u32(string &img, uint32_t v) {
+    img.append(reinterpret_cast<const char*>(&v), 4);
+}
+
+// ttl: write the BK_FLAG_TTL record layout; keys already expired are dropped here
+static void serialize_records(const Bucket &bk, string &img, bool delta, bool ttl) {
+    uint32_t now = now_seconds();
+    string logical;
+    for (const auto &kv : bk.map) {
+        const string &key = kv.first;
+        const Postings &vals = kv.second;
+        uint32_t deadline = 0;
+        if (ttl) {
+            // a sharded key's deadline rides on its directory record
+            size_t len = logical_len(key);
+            if (len < key.size()) logical.assign(key, 0, len);
+            auto it = bk.expiry.find(len < key.size() ? logical : key);
+            if (it != bk.expiry.end()) {
+                if (it->second <= now) continue;
+                if (len == key.size() || is_shard_dir(key)) deadline = it->second;
+            }
+            put_varint(img, (uint32_t)key.size() << 1 | (deadline ? 1 : 0));
+        } else {
+            put_varint(img, (uint32_t)key.size());
+        }
+        img.append(key);
+        if (deadline) put_u32(img, deadline);
+        put_u32(img, (uint32_t)vals.size());
+        if (!delta) {
+            img.append(reinterpret_cast<const char*>(vals.data()), vals.size() * sizeof(int));
+            continue;
+        }
+        uint32_t prev = 0;
+        for (int v : vals) {
+            put_varint(img, (uint32_t)v - prev);
+            prev = (uint32_t)v;
+        }
+    }
+}
+
+// Compaction side of the size classes: lists more than one class above their size
+// (after deletes) move to a block of their own class, and lists pinning a sparse slab
+// move to a fuller one
+static void shrink_postings(Bucket &bk) {
+    for (auto &kv : bk.map) {
+        Postings &vals = kv.second;
+        if (vals.capacity() <= posting_class_cap(posting_class(vals.size()) + 1) &&
+            !posting_sparse(vals.data(), vals.capacity())) {
+            continue;
+        }
+        Postings tight;
+        tight.reserve(posting_capacity(vals.size()));
+        tight.assign(vals.begin(), vals.end());
+        vals.swap(tight);
+    }
+}
+
+static void flush_bucket_binary_file(const string &path, Bucket &bk) {
+    TraceSpan span("flush_bucket_binary_file");
+    filesystem::create_directories(filesystem::path(path).parent_path());
+    string img;
+    bool ttl = !bk.expiry.empty();
+    char flags = (char)(BK_FLAG_VARINT_KLEN | (ttl ? BK_FLAG_TTL : 0));
+    if (opt.compress) {
+        string raw;
+        serialize_records(bk, raw, true, ttl);
+        img.assign("BK3\0\0\0\0\0", 8);
+        put_u32(img, (uint32_t)raw.size());
+        lz_compress(raw.data(), raw.size(), img);
+    } else {
+        img.assign("BK2\0\0\0\0\0", 8);
+        serialize_records(bk, img, false, ttl);
+    }
+    img[3] = flags;
+    uint32_t base = (uint32_t)img.size();
+    memcpy(&img[4], &base, 4);
+    string tmp = path + ".tmp";
+    {
+        ofstream fout(tmp, ios::binary);
+        fout.write(img.data(), (streamsize)img.size());
+        fout.flush();
+    }
+    counters.bytes_written.fetch_add(img.size(), memory_order_relaxed);
+    std::error_code ec;
+    filesystem::rename(tmp, path, ec);
+    if (ec) {
+        filesystem::remove(path);
+        filesystem::rename(tmp, path);
+    }
+    bk.base_bytes = base;
+    bk.journal_bytes = 0;
+    bk.varint_klen = true;
+    shrink_postings(bk);
+}
+
+// Appends this run's mutations after the base image; false when a full rewrite is due
+static bool append_bucket_journal(const string &path, Bucket &bk) {
+    if (!bk.base_bytes || bk.pending_overflow || !bk.varint_klen) return false;
+    TraceSpan span("append_bucket_journal");
+    const string &rec = bk.pending;
+    uint64_t total = bk.journal_bytes + rec.size();
+    if (total > max<uint64_t>(JOURNAL_FOLD_MIN, bk.base_bytes / 2)) return false;
+    uint64_t off = bk.base_bytes + bk.journal_bytes;
+    // Drop a torn tail left by an interrupted append before writing past it
+    std::error_code ec;
+    filesystem::resize_file(path, off, ec);
+    if (ec) return false;
+    FILE *f = fopen(path.c_str(), "r+b");
+    if (!f) return false;
+    bool ok = fseek(f, (long)off, SEEK_SET) == 0 && fwrite(rec.data(), 1, rec.size(), f) == rec.size();
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) return false;
+    counters.bytes_written.fetch_add(rec.size(), memory_order_relaxed);
+    bk.journal_bytes = total;
+    return true;
+}
+
+// Replication (primary side): mutations are batched into frames [u32 bytes][log entries]
+// and written to the standby's socket; a failed write drops replication for the run.
+// A frame holds REPL_BATCH bytes plus one entry; the standby rejects any frame over
+// REPL_FRAME_MAX, so its receive buffer stays well inside the memory budget.
+static const size_t REPL_BATCH = 1 << 16;
+static const size_t REPL_FRAME_MAX = 1 << 20;
+static int repl_fd = -1;
+static string repl_buf;
+
+static void replicate_flush() {
+    if (repl_fd < 0 || repl_buf.empty()) return;
+    if (repl_buf.size() > REPL_FRAME_MAX) {
+        fprintf(stderr, "replication: %zu-byte frame over the limit, dropped\n", repl_buf.size());
+        close(repl_fd);
+        repl_fd = -1;
+        return;
+    }
+    uint32_t bytes = (uint32_t)repl_buf.size();
+    string frame(reinterpret_cast<const char*>(&bytes), 4);
+    frame.append(repl_buf);
+    repl_buf.clear();
+    size_t done = 0;
+    while (done < frame.size()) {
+        ssize_t put = write(repl_fd, frame.data() + done, frame.size() - done);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) {
+            perror("replication: write");
+            close(repl_fd);
+            repl_fd = -1;
+            return;
+        }
+        done += (size_t)put;
+    }
+}
+
+static void replicate_op(char op, const string &key, int val) {
+    if (repl_fd < 0) return;
+    put_log_entry(repl_buf, op, key, val);
+    if (repl_buf.size() >= REPL_BATCH) replicate_flush();
+}
+
+static int unix_socket(const string &path, sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+static void replicate_connect(const string &path) {
+    signal(SIGPIPE, SIG_IGN);
+    sockaddr_un addr;
+    repl_fd = unix_socket(path, addr);
+    if (repl_fd >= 0 && connect(repl_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) return;
+    perror("replication: connect");
+    if (repl_fd >= 0) close(repl_fd);
+    repl_fd = -1;
+}
+
+// Records an effective mutation: shipped to the standby and queued for the bucket journal
+static void journal_op(Bucket &bk, char op, const string &key, int val) {
+    replicate_op(op, key, val);
+    if (!bk.base_bytes || bk.pending_overflow) return; // a full rewrite is coming anyway
+    if (bk.pending_ops >= JOURNAL_MAX_PENDING) {
+        bk.pending_overflow = true;
+        string().swap(bk.pending);
+        return;
+    }
+    put_log_entry(bk.pending, op, key, val);
+    ++bk.pending_ops;
+}
+
+static void flush_bucket_to_disk(int b, Bucket &bk) {
+    if (!bk.dirty) return;
+    string path = bucket_path(b);
+    uint64_t t0 = lat_hist ? lat_now() : 0;
+    int kind = LAT_FLUSH_APPEND;
+    if (!append_bucket_journal(path, bk)) {
+        flush_bucket_binary_file(path, bk);
+        kind = LAT_FLUSH_REWRITE;
+    }
+    (kind == LAT_FLUSH_APPEND ? counters.flush_appends : counters.flush_rewrites).fetch_add(1, memory_order_relaxed);
+    if (lat_hist) lat_hist[kind].record(lat_now() - t0);
+    if (!bk.moved_from.empty()) {
+        filesystem::remove(bk.moved_from);
+        bk.moved_from.clear();
+    }
+    bk.dirty = false;
+    bk.pending_overflow = false;
+    bk.pending_ops = 0;
+    string().swap(bk.pending);
+}
+
+static void evict_if_needed() {
+    if ((int)cache.size() < cache_cap()) return;
+    TraceSpan span("evict_if_needed");
+    // Evict least recently used (back)
+    int victim = lru.back();
+    lru.pop_back();
+    ++counters.evictions;
+    where.erase(victim);
+    auto it = cache.find(victim);
+    if (it != cache.end()) {
+        flush_bucket_to_disk(victim, it->second);
+        cache.erase(it);
+    }
+}
+
+// Reads bucket b from wherever it lives; a misplaced bucket comes back dirty with no
+// base image, so its next flush is a full rewrite into the ring directory.
+static void read_bucket(int b, Bucket &bk) {
+    string path = locate_bucket(b);
+    if (!load_bucket_binary_file(path, bk)) {
+        bk.map.clear();
+        bk.expiry.clear();
+        bk.base_bytes = bk.journal_bytes = 0;
+        load_bucket_text_file(path, bk);
+    }
+    bk.dirty = false;
+    if (path != bucket_path(b)) {
+        bk.moved_from = path;
+        bk.base_bytes = bk.journal_bytes = 0;
+        bk.dirty = true;
+    }
+}
+
+// Prewarming (--prewarm): every load_bucket call counts toward its bucket's heat, and at
+// exit heat = previous heat / 2 + this run's accesses is saved to data/heat (heat.<k> for
+// router worker k). At startup a reader thread loads the hottest buckets -- the fewest
+// covering PREWARM_COVER of the heat, at most cache_cap() -- into a staging area
+// while the main thread parses commands. The first access to a staged bucket adopts it
+// into the cache (waiting if its read is under way); a bucket reached before the reader
+// gets to it is loaded as usual and dropped from the reader's queue. The reader locates
+// buckets through the layout, so it is stopped before a reshard step rewrites it.
+static const char *HEAT_MAGIC = "HEAT1";
+static const double PREWARM_COVER = 0.9;
+
+enum PrewarmState { PW_NONE, PW_QUEUED, PW_LOADING, PW_READY, PW_TAKEN };
+
+struct Prewarm {
+    mutex mu;
+    condition_variable cv;
+    vector<PrewarmState> state; // by slot
+    vector<Bucket> staged;
+    vector<int> order;
+    thread reader;
+    bool stop = false;
+    bool active = false; // reader started and not yet stopped (main thread only)
+    size_t loaded = 0, used = 0, waited = 0;
+};
+
+static Prewarm prewarm;
+static uint64_t bucket_accesses[MAX_SLOTS];
+static double bucket_heat[MAX_SLOTS]; // as read at startup
+
+static string heat_path() {
+    string path = primary_dir() + "/heat";
+    if (opt.worker) path += "." + to_string(opt.worker_index);
+    return path;
+}
+
+static void read_heat() {
+    FILE *fp = fopen(heat_path().c_str(), "r");
+    if (!fp) return;
+    char magic[8] = {};
+    int b;
+    double h;
+    if (fscanf(fp, "%7s", magic) == 1 && strcmp(magic, HEAT_MAGIC) == 0) {
+        while (fscanf(fp, "%d %lf", &b, &h) == 2) {
+            if (b >= 0 && b < slot_count() && h > 0) bucket_heat[b] = h;
+        }
+    }
+    fclose(fp);
+}
+
+static void write_heat() {
+    string path = heat_path(), tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (!fp) return;
+    fprintf(fp, "%s\n", HEAT_MAGIC);
+    for (int b = 0; b < slot_count(); ++b) {
+        double h = bucket_heat[b] / 2 + (double)bucket_accesses[b];
+        if (h >= 0.01) fprintf(fp, "%d %.6g\n", b, h);
+    }
+    fclose(fp);
+    error_code ec;
+    filesystem::rename(tmp, path, ec);
+}
+
+static void start_prewarm() {
+    read_heat();
+    prewarm.state.assign(slot_count(), PW_NONE);
+    prewarm.staged.resize(slot_count());
+    vector<int> byheat;
+    double total = 0;
+    for (int b = 0; b < slot_count(); ++b) {
+        if (bucket_heat[b] > 0) byheat.push_back(b);
+        total += bucket_heat[b];
+    }
+    sort(byheat.begin(), byheat.end(), [](int x, int y) { return bucket_heat[x] > bucket_heat[y]; });
+    double covered = 0;
+    for (int b : byheat) {
+        if (covered >= PREWARM_COVER * total || (int)prewarm.order.size() >= cache_cap()) break;
+        prewarm.order.push_back(b);
+        prewarm.state[b] = PW_QUEUED;
+        covered += bucket_heat[b];
+    }
+    if (prewarm.order.empty()) return;
+    prewarm.active = true;
+    prewarm.reader = thread([] {
+        for (int b : prewarm.order) {
+            {
+                lock_guard<mutex> lock(prewarm.mu);
+                if (prewarm.stop) break;
+                if (prewarm.state[b] != PW_QUEUED) continue;
+                prewarm.state[b] = PW_LOADING;
+            }
+            Bucket bk;
+            {
+                TraceSpan span("prewarm_bucket");
+                read_bucket(b, bk);
+            }
+            {
+                lock_guard<mutex> lock(prewarm.mu);
+                prewarm.staged[b] = std::move(bk);
+                prewarm.state[b] = PW_READY;
+                ++prewarm.loaded;
+            }
+            prewarm.cv.notify_all();
+        }
+    });
+}
+
+// Hands over bucket b if the reader has (or is about to have) it; false: load it yourself
+static bool prewarm_take(int b, Bucket &bk) {
+    if (!prewarm.active) return false;
+    unique_lock<mutex> lock(prewarm.mu);
+    if (prewarm.state[b] == PW_QUEUED) prewarm.state[b] = PW_TAKEN;
+    if (prewarm.state[b] == PW_LOADING) {
+        ++prewarm.waited;
+        prewarm.cv.wait(lock, [b] { return prewarm.state[b] == PW_READY; });
+    }
+    if (prewarm.state[b] != PW_READY) return false;
+    bk = std::move(prewarm.staged[b]);
+    prewarm.state[b] = PW_TAKEN;
+    ++prewarm.used;
+    return true;
+}
+
+// Joins the reader; buckets staged but never used are clean, so they are just dropped
+static void stop_prewarm() {
+    if (!prewarm.active) return;
+    {
+        lock_guard<mutex> lock(prewarm.mu);
+        prewarm.stop = true;
+    }
+    if (prewarm.reader.joinable()) prewarm.reader.join();
+    for (Bucket &bk : prewarm.staged) bk = Bucket();
+    prewarm.active = false;
+}
+
+static void finish_prewarm() {
+    stop_prewarm();
+    write_heat();
+    if (opt.stats) {
+        fprintf(stderr, "prewarm: queued=%zu loaded=%zu used=%zu waited=%zu\n", prewarm.order.size(), prewarm.loaded,
+                prewarm.used, prewarm.waited);
+    }
+}
+
+static Bucket &load_bucket(int b) {
+    ++bucket_accesses[b];
+    auto it = cache.find(b);
+    if (it != cache.end()) {
+        ++counters.cache_hits;
+        touch_lru(b);
+        return it->second;
+    }
+    TraceSpan span("load_bucket"); // misses only: hits are a hash lookup
+    evict_if_needed();
+    Bucket bk;
+    {
+        LatencyTimer t(LAT_LOAD_MISS);
+        if (!prewarm_take(b, bk)) read_bucket(b, bk);
+    }
+    auto [insIt, _] = cache.emplace(b, std::move(bk));
+    touch_lru(b);
+    return insIt->second;
+}
+
+// Online reshard: every RESHARD_EVERY commands one old bucket moves to the new layout.
+// The step flushes the old bucket (its file stays the truth until the marker moves),
+// rewrites every new bucket that received keys, then advances layout.migrated on disk
+// and deletes the old file. A step interrupted by a crash is simply redone: the first
+// step of a run first drops any copies of that old bucket's keys from the new layout.
+static const long RESHARD_EVERY = 256;
+static bool reshard_resumed = false;
+
+static void start_reshard(int n) {
+    if (layout.to) {
+        if (n != layout.to) fprintf(stderr, "reshard: the move to %d buckets must finish first\n", layout.to);
+        return;
+    }
+    if (n == layout.from) return;
+    layout.to = n;
+    layout.migrated = 0;
+    write_layout();
+}
+
+static void reshard_step() {
+    stop_prewarm();
+    int m = layout.migrated;
+    Bucket src;
+    {
+        Bucket &bk = load_bucket(m);
+        flush_bucket_to_disk(m, bk);
+        src = std::move(bk);
+    }
+    cache.erase(m);
+    lru.erase(where[m]);
+    where.erase(m);
+    set<int> touched;
+    if (!reshard_resumed) {
+        reshard_resumed = true;
+        for (int t = layout.from; t < slot_count(); ++t) {
+            Bucket &tb = load_bucket(t);
+            for (auto it = tb.map.begin(); it != tb.map.end();) {
+                if ((int)(key_hash(it->first) % layout.from) != m) {
+                    ++it;
+                    continue;
+                }
+                tb.expiry.erase(logical_key(it->first));
+                it = tb.map.erase(it);
+                touched.insert(t);
+            }
+        }
+    }
+    for (auto &kv : src.map) {
+        int t = layout.from + (int)(key_hash(kv.first) % layout.to);
+        Bucket &tb = load_bucket(t);
+        auto dl = src.expiry.find(logical_key(kv.first));
+        if (dl != src.expiry.end()) tb.expiry[dl->first] = dl->second;
+        if (is_shard_dir(kv.first)) tb.shards = true;
+        tb.map[kv.first] = std::move(kv.second);
+        touched.insert(t);
+    }
+    for (int t : touched) {
+        Bucket &tb = load_bucket(t);
+        tb.dirty = true;
+        tb.pending_overflow = true; // full rewrite, not a journal append
+        flush_bucket_to_disk(t, tb);
+    }
+    ++layout.migrated;
+    write_layout();
+    error_code ec;
+    filesystem::remove(locate_bucket(m), ec);
+    if (opt.stats) fprintf(stderr, "reshard: bucket %d of %d moved (%zu keys)\n", m + 1, layout.from, src.map.size());
+}
+
+// Namespaces: tenant 0 is the default namespace; others qualify their keys with a prefix.
+// Qualified keys sort by namespace, so in the paged engine each tenant's pages cluster,
+// and pool frames are charged to the tenant whose miss loaded them.
+static const char NS_SEP = '\x1f'; // never part of an input token (<= ' ')
+
+struct Tenant {
+    string name;
+    size_t frames = 0; // paged pool frames charged to this tenant
+    uint64_t ops = 0;
+};
+
+static vector<Tenant> tenants(1);
+static unordered_map<string, int> tenant_ids = {{"", 0}};
+static int cur_tenant = 0;
+
+// "use -" returns to the default namespace (the tokenizer cannot produce an empty name)
+static void use_namespace(const string &ns) {
+    auto it = tenant_ids.find(ns == "-" ? string() : ns);
+    if (it == tenant_ids.end()) {
+        it = tenant_ids.emplace(ns, (int)tenants.size()).first;
+        tenants.push_back(Tenant());
+        tenants.back().name = ns;
+    }
+    cur_tenant = it->second;
+}
+
+// Storage key for idx in the current namespace; may return a reference to a scratch buffer
+static const string &qualify(const string &idx) {
+    if (!cur_tenant) return idx;
+    static string qkey;
+    qkey.assign(tenants[cur_tenant].name);
+    qkey.push_back(NS_SEP);
+    qkey.append(idx);
+    return qkey;
+}
+
+// Paged engine (--paged): one B+ tree of (key, value) pairs in data/pages.dat.
+// Fixed 4 KiB pages go through a bounded buffer pool (clock eviction), so memory stays
+// at pool_pages * 4 KiB regardless of dataset size and every op touches O(height) pages.
+//   page 0: meta  ['BPT1'][u32 root][u32 npages][u32 height][u64 entries]
+//   leaf:  [u16 type=1][u16 count][u32 next leaf] count * slot
+//   inner: [u16 type=2][u16 count][u32 child0]    count * (slot, u32 child) ; child i+1 >= slot i
+//   slot:  [u8 klen][64 key bytes][i32 value], ordered by (key, value)
+// Keys longer than 64 bytes spill to overflow pages so hot pages keep fixed-size slots:
+//   slot key area: klen = 0xFF, [56-byte prefix][u32 first overflow page][u32 key length]
+//   overflow:      [u16 type=3][u16 used][u32 next] used bytes of the key suffix
+// Overflow pages bypass the pool: they are written once and read only on a prefix tie,
+// and all values of one key share its chain.
+// Deletes do not merge pages; emptied leaves stay linked and are skipped by scans.
+static const size_t PAGE_SIZE = 4096;
+static const size_t PAGED_KEY_MAX = 64;
+static const size_t SLOT_BYTES = 1 + PAGED_KEY_MAX + 4;
+static const size_t PAGE_HDR = 8;
+static const size_t INNER_ENTRY = SLOT_BYTES + 4;
+static const uint16_t LEAF_CAP = (PAGE_SIZE - PAGE_HDR) / SLOT_BYTES;
+static const uint16_t INNER_CAP = (PAGE_SIZE - PAGE_HDR) / INNER_ENTRY;
+static const uint16_t PAGE_LEAF = 1, PAGE_INNER = 2, PAGE_OVERFLOW = 3;
+static const unsigned char SLOT_OVERFLOW = 0xFF;
+static const size_t OVERFLOW_PREFIX = PAGED_KEY_MAX - 8;
+static const size_t OVERFLOW_DATA = PAGE_SIZE - PAGE_HDR;
+
+struct PagedMeta {
+    uint32_t root = 0;
+    uint32_t npages = 0;
+    uint32_t height = 1;
+    uint64_t entries = 0;
+};
+
+struct PoolFrame {
+    uint32_t id = UINT32_MAX;
+    bool dirty = false;
+    bool ref = false;
+    int owner = 0; // tenant charged for this frame
+};
+
+struct PagedStats {
+    uint64_t fetches = 0; // logical page accesses
+    uint64_t reads = 0;   // pool misses served from disk
+    uint64_t writes = 0;  // dirty pages written back
+    uint64_t ops = 0;
+};
+
+// Pages written since the last backup, one bit per change_stride pages, stored in the
+// meta page after the header. Stride 0 means unknown (new file, restored, or written
+// before the map existed): the next backup copies every page. The map starts where the
+// header (magic, root, npages, height, entries, change_stride) ends.
+static const size_t CHANGE_MAP_OFF = 28;
+static const size_t CHANGE_MAP_BITS = (PAGE_SIZE - CHANGE_MAP_OFF) * 8;
+
+static FILE *paged_fp = nullptr;
+static vector<uint8_t> page_changes(CHANGE_MAP_BITS / 8);
+static uint32_t change_stride = 0;
+static PagedMeta pmeta;
+static PagedStats pstats;
+static vector<PoolFrame> pool_frames;
+static vector<char> pool_mem;
+static unordered_map<uint32_t, uint32_t> pool_table; // page id -> frame
+static size_t pool_hand = 0;
+
+static string paged_path() {
+    return primary_dir() + "/pages.dat";
+}
+
+static void mark_page_changed(uint32_t id) {
+    if (!change_stride) return;
+    while (id / change_stride >= CHANGE_MAP_BITS) {
+        // fold bit pairs so each bit covers twice as many pages
+        vector<uint8_t> folded(page_changes.size());
+        for (size_t i = 0; i < CHANGE_MAP_BITS; ++i) {
+            if (page_changes[i >> 3] >> (i & 7) & 1) folded[i >> 4] |= (uint8_t)(1 << ((i >> 1) & 7));
+        }
+        page_changes.swap(folded);
+        change_stride *= 2;
+    }
+    size_t bit = id / change_stride;
+    page_changes[bit >> 3] |= (uint8_t)(1 << (bit & 7));
+}
+
+static void paged_write_back(uint32_t f) {
+    PoolFrame &fr = pool_frames[f];
+    if (!fr.dirty) return;
+    fseek(paged_fp, (long)fr.id * (long)PAGE_SIZE, SEEK_SET);
+    fwrite(&pool_mem[(size_t)f * PAGE_SIZE], 1, PAGE_SIZE, paged_fp);
+    mark_page_changed(fr.id);
+    fr.dirty = false;
+    ++pstats.writes;
+}
+
+// Clock sweep with fair sharing: a frame is only taken from another tenant while that
+// tenant holds more than pool / active tenants; after two passes any cold frame goes.
+static uint32_t pool_victim() {
+    size_t n = pool_frames.size(), active = 0;
+    for (const Tenant &t : tenants) active += t.frames > 0;
+    if (!tenants[cur_tenant].frames) ++active;
+    size_t share = max<size_t>(1, n / active);
+    for (size_t step = 0;; ++step) {
+        uint32_t f = (uint32_t)pool_hand;
+        pool_hand = (pool_hand + 1) % n;
+        PoolFrame &fr = pool_frames[f];
+        if (fr.id == UINT32_MAX) return f;
+        bool fair = fr.owner == cur_tenant || tenants[fr.owner].frames > share || step >= 2 * n;
+        if (!fair) continue;
+        if (fr.ref && step < 4 * n) {
+            fr.ref = false;
+            continue;
+        }
+        return f;
+    }
+}
+
+// Returns the page image; the pointer stays valid only until the next paged_page call.
+// fresh: the page was just allocated, so skip the disk read and start zeroed.
+static char *paged_page(uint32_t id, bool dirty, bool fresh = false) {
+    ++pstats.fetches;
+    auto it = pool_table.find(id);
+    uint32_t f;
+    if (it != pool_table.end()) {
+        f = it->second;
+    } else {
+        f = pool_victim();
+        PoolFrame &fr = pool_frames[f];
+        if (fr.id != UINT32_MAX) {
+            paged_write_back(f);
+            pool_table.erase(fr.id);
+            --tenants[fr.owner].frames;
+        }
+        fr.id = id;
+        fr.owner = cur_tenant;
+        ++tenants[cur_tenant].frames;
+        char *data = &pool_mem[(size_t)f * PAGE_SIZE];
+        memset(data, 0, PAGE_SIZE);
+        if (!fresh) {
+            fseek(paged_fp, (long)id * (long)PAGE_SIZE, SEEK_SET);
+            if (fread(data, 1, PAGE_SIZE, paged_fp) != PAGE_SIZE) memset(data, 0, PAGE_SIZE);
+            ++pstats.reads;
+        }
+        pool_table.emplace(id, f);
+    }
+    PoolFrame &fr = pool_frames[f];
+    fr.ref = true;
+    fr.dirty = fr.dirty || dirty;
+    return &pool_mem[(size_t)f * PAGE_SIZE];
+}
+
+static uint32_t paged_alloc(uint16_t type) {
+    uint32_t id = pmeta.npages++;
+    char *pg = paged_page(id, true, true);
+    memcpy(pg, &type, 2);
+    return id;
+}
+
+static uint16_t page_type(const char *pg) { uint16_t t; memcpy(&t, pg, 2); return t; }
+static uint16_t page_count(const char *pg) { uint16_t c; memcpy(&c, pg + 2, 2); return c; }
+static void set_page_count(char *pg, uint16_t c) { memcpy(pg + 2, &c, 2); }
+static uint32_t page_link(const char *pg) { uint32_t l; memcpy(&l, pg + 4, 4); return l; }
+static void set_page_link(char *pg, uint32_t l) { memcpy(pg + 4, &l, 4); }
+static char *leaf_slot(char *pg, size_t i) { return pg + PAGE_HDR + i * SLOT_BYTES; }
+static char *inner_entry(char *pg, size_t i) { return pg + PAGE_HDR + i * INNER_ENTRY; }
+
+static uint32_t inner_child(char *pg, size_t i) {
+    if (i == 0) return page_link(pg);
+    uint32_t c;
+    memcpy(&c, inner_entry(pg, i - 1) + SLOT_BYTES, 4);
+    return c;
+}
+
+static uint32_t paged_write_overflow(const char *p, size_t n) {
+    uint32_t first = pmeta.npages;
+    uint32_t pages = (uint32_t)((n + OVERFLOW_DATA - 1) / OVERFLOW_DATA);
+    pmeta.npages += pages;
+    char pg[PAGE_SIZE];
+    for (uint32_t i = 0; i < pages; ++i) {
+        size_t used = min(OVERFLOW_DATA, n - i * OVERFLOW_DATA);
+        memset(pg, 0, PAGE_SIZE);
+        memcpy(pg, &PAGE_OVERFLOW, 2);
+        set_page_count(pg, (uint16_t)used);
+        set_page_link(pg, i + 1 < pages ? first + i + 1 : 0);
+        memcpy(pg + PAGE_HDR, p + i * OVERFLOW_DATA, used);
+        fseek(paged_fp, (long)(first + i) * (long)PAGE_SIZE, SEEK_SET);
+        fwrite(pg, 1, PAGE_SIZE, paged_fp);
+        mark_page_changed(first + i);
+        ++pstats.writes;
+    }
+    return first;
+}
+
+static void paged_read_overflow(uint32_t id, size_t n, string &dst) {
+    dst.clear();
+    char pg[PAGE_SIZE];
+    while (id && dst.size() < n) {
+        fseek(paged_fp, (long)id * (long)PAGE_SIZE, SEEK_SET);
+        if (fread(pg, 1, PAGE_SIZE, paged_fp) != PAGE_SIZE) break;
+        ++pstats.reads;
+        dst.append(pg + PAGE_HDR, min<size_t>(page_count(pg), OVERFLOW_DATA));
+        id = page_link(pg);
+    }
+}
+
+// overflow: first overflow page of the key (ignored for keys that fit inline)
+static void make_slot(char *slot, const string &key, int val, uint32_t overflow) {
+    memset(slot, 0, SLOT_BYTES);
+    if (key.size() <= PAGED_KEY_MAX) {
+        slot[0] = (char)key.size();
+        memcpy(slot + 1, key.data(), key.size());
+    } else {
+        uint32_t len = (uint32_t)key.size();
+        slot[0] = (char)SLOT_OVERFLOW;
+        memcpy(slot + 1, key.data(), OVERFLOW_PREFIX);
+        memcpy(slot + 1 + OVERFLOW_PREFIX, &overflow, 4);
+        memcpy(slot + 1 + OVERFLOW_PREFIX + 4, &len, 4);
+    }
+    memcpy(slot + 1 + PAGED_KEY_MAX, &val, 4);
+}
+
+static int slot_value(const char *slot) {
+    int v;
+    memcpy(&v, slot + 1 + PAGED_KEY_MAX, 4);
+    return v;
+}
+
+static uint32_t slot_overflow(const char *slot) {
+    if ((unsigned char)slot[0] != SLOT_OVERFLOW) return 0;
+    uint32_t id;
+    memcpy(&id, slot + 1 + OVERFLOW_PREFIX, 4);
+    return id;
+}
+
+static int len_cmp(size_t a, size_t b) {
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+// Compares key against the slot's key (std::string order)
+static int key_cmp(const string &key, const char *slot) {
+    size_t l = (unsigned char)slot[0];
+    if (l != SLOT_OVERFLOW) {
+        int c = memcmp(key.data(), slot + 1, min(key.size(), l));
+        return c ? c : len_cmp(key.size(), l);
+    }
+    int c = memcmp(key.data(), slot + 1, min(key.size(), OVERFLOW_PREFIX));
+    if (c) return c;
+    if (key.size() <= OVERFLOW_PREFIX) return -1;
+    uint32_t len;
+    memcpy(&len, slot + 1 + OVERFLOW_PREFIX + 4, 4);
+    static string suffix;
+    paged_read_overflow(slot_overflow(slot), len - OVERFLOW_PREFIX, suffix);
+    size_t rest = key.size() - OVERFLOW_PREFIX;
+    c = memcmp(key.data() + OVERFLOW_PREFIX, suffix.data(), min(rest, suffix.size()));
+    return c ? c : len_cmp(rest, suffix.size());
+}
+
+static int probe_cmp(const string &key, int val, const char *slot) {
+    int c = key_cmp(key, slot);
+    if (c) return c;
+    int sv = slot_value(slot);
+    return val < sv ? -1 : (val > sv ? 1 : 0);
+}
+
+// Index of the first slot >= (key, val) in a leaf
+static size_t leaf_lower_bound(char *pg, const string &key, int val) {
+    size_t lo = 0, hi = page_count(pg);
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (probe_cmp(key, val, leaf_slot(pg, mid)) > 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Child index to descend into: number of separators <= (key, val)
+static size_t inner_route(char *pg, const string &key, int val) {
+    size_t lo = 0, hi = page_count(pg);
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (probe_cmp(key, val, inner_entry(pg, mid)) >= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static uint32_t paged_find_leaf(const string &key, int val) {
+    uint32_t pid = pmeta.root;
+    for (;;) {
+        char *pg = paged_page(pid, false);
+        if (page_type(pg) != PAGE_INNER) return pid;
+        pid = inner_child(pg, inner_route(pg, key, val));
+    }
+}
+
+struct PagedSplit {
+    char sep[SLOT_BYTES];
+    uint32_t right;
+};
+
+// Returns 0 = duplicate, 1 = inserted, 2 = inserted and pid split into (pid, sp.right)
+static int paged_insert_rec(uint32_t pid, const string &key, int val, PagedSplit &sp) {
+    char *pg = paged_page(pid, false);
+    uint16_t cnt = page_count(pg);
+    if (page_type(pg) != PAGE_INNER) {
+        size_t pos = leaf_lower_bound(pg, key, val);
+        if (pos < cnt && probe_cmp(key, val, leaf_slot(pg, pos)) == 0) return 0;
+        uint32_t ovf = 0;
+        if (key.size() > PAGED_KEY_MAX) {
+            // Values of a key are adjacent: share a neighbour's chain when there is one
+            if (pos < cnt && key_cmp(key, leaf_slot(pg, pos)) == 0) ovf = slot_overflow(leaf_slot(pg, pos));
+            else if (pos > 0 && key_cmp(key, leaf_slot(pg, pos - 1)) == 0) ovf = slot_overflow(leaf_slot(pg, pos - 1));
+            else ovf = paged_write_overflow(key.data() + OVERFLOW_PREFIX, key.size() - OVERFLOW_PREFIX);
+        }
+        char slot[SLOT_BYTES];
+        make_slot(slot, key, val, ovf);
+        pg = paged_page(pid, true);
+        if (cnt < LEAF_CAP) {
+            memmove(leaf_slot(pg, pos + 1), leaf_slot(pg, pos), (cnt - pos) * SLOT_BYTES);
+            memcpy(leaf_slot(pg, pos), slot, SLOT_BYTES);
+            set_page_count(pg, cnt + 1);
+            return 1;
+        }
+        static char merged[(LEAF_CAP + 1) * SLOT_BYTES];
+        memcpy(merged, leaf_slot(pg, 0), pos * SLOT_BYTES);
+        memcpy(merged + pos * SLOT_BYTES, slot, SLOT_BYTES);
+        memcpy(merged + (pos + 1) * SLOT_BYTES, leaf_slot(pg, pos), (cnt - pos) * SLOT_BYTES);
+        uint16_t left = (uint16_t)((cnt + 1) / 2), right = (uint16_t)(cnt + 1 - left);
+        uint32_t next = page_link(pg);
+        sp.right = paged_alloc(PAGE_LEAF);
+        char *rp = paged_page(sp.right, true);
+        memcpy(leaf_slot(rp, 0), merged + left * SLOT_BYTES, right * SLOT_BYTES);
+        set_page_count(rp, right);
+        set_page_link(rp, next);
+        pg = paged_page(pid, true);
+        memcpy(leaf_slot(pg, 0), merged, left * SLOT_BYTES);
+        set_page_count(pg, left);
+        set_page_link(pg, sp.right);
+        memcpy(sp.sep, merged + left * SLOT_BYTES, SLOT_BYTES);
+        return 2;
+    }
+    size_t ci = inner_route(pg, key, val);
+    PagedSplit child;
+    int r = paged_insert_rec(inner_child(pg, ci), key, val, child);
+    if (r != 2) return r;
+    pg = paged_page(pid, true);
+    cnt = page_count(pg);
+    if (cnt < INNER_CAP) {
+        memmove(inner_entry(pg, ci + 1), inner_entry(pg, ci), (cnt - ci) * INNER_ENTRY);
+        memcpy(inner_entry(pg, ci), child.sep, SLOT_BYTES);
+        memcpy(inner_entry(pg, ci) + SLOT_BYTES, &child.right, 4);
+        set_page_count(pg, cnt + 1);
+        return 1;
+    }
+    static char merged[(INNER_CAP + 1) * INNER_ENTRY];
+    memcpy(merged, inner_entry(pg, 0), ci * INNER_ENTRY);
+    memcpy(merged + ci * INNER_ENTRY, child.sep, SLOT_BYTES);
+    memcpy(merged + ci * INNER_ENTRY + SLOT_BYTES, &child.right, 4);
+    memcpy(merged + (ci + 1) * INNER_ENTRY, inner_entry(pg, ci), (cnt - ci) * INNER_ENTRY);
+    // Entry `mid` moves up; its child becomes child0 of the new right node
+    uint16_t mid = (uint16_t)((cnt + 1) / 2), right = (uint16_t)(cnt - mid);
+    uint32_t right_child0;
+    memcpy(&right_child0, merged + mid * INNER_ENTRY + SLOT_BYTES, 4);
+    sp.right = paged_alloc(PAGE_INNER);
+    char *rp = paged_page(sp.right, true);
+    memcpy(inner_entry(rp, 0), merged + (mid + 1) * INNER_ENTRY, right * INNER_ENTRY);
+    set_page_count(rp, right);
+    set_page_link(rp, right_child0);
+    pg = paged_page(pid, true);
+    memcpy(inner_entry(pg, 0), merged, mid * INNER_ENTRY);
+    set_page_count(pg, mid);
+    memcpy(sp.sep, merged + mid * INNER_ENTRY, SLOT_BYTES);
+    return 2;
+}
+
+static void paged_new_root(const PagedSplit &sp) {
+    uint32_t old = pmeta.root;
+    uint32_t root = paged_alloc(PAGE_INNER);
+    char *pg = paged_page(root, true);
+    set_page_link(pg, old);
+    memcpy(inner_entry(pg, 0), sp.sep, SLOT_BYTES);
+    memcpy(inner_entry(pg, 0) + SLOT_BYTES, &sp.right, 4);
+    set_page_count(pg, 1);
+    pmeta.root = root;
+    ++pmeta.height;
+}
+
+static void paged_insert(const string &idx, int val) {
+    PagedSplit sp;
+    int r = paged_insert_rec(pmeta.root, idx, val, sp);
+    if (r) {
+        ++pmeta.entries;
+        replicate_op('I', idx, val);
+    }
+    if (r == 2) paged_new_root(sp);
+}
+
+static void paged_delete(const string &idx, int val) {
+    uint32_t pid = paged_find_leaf(idx, val);
+    char *pg = paged_page(pid, false);
+    uint16_t cnt = page_count(pg);
+    size_t pos = leaf_lower_bound(pg, idx, val);
+    if (pos >= cnt || probe_cmp(idx, val, leaf_slot(pg, pos)) != 0) return;
+    pg = paged_page(pid, true);
+    memmove(leaf_slot(pg, pos), leaf_slot(pg, pos + 1), (cnt - pos - 1) * SLOT_BYTES);
+    set_page_count(pg, cnt - 1);
+    --pmeta.entries;
+    replicate_op('D', idx, val);
+}
+
+// Appends the values of idx to dst in ascending order
+static void paged_values(const string &idx, vector<int> &dst) {
+    uint32_t pid = paged_find_leaf(idx, INT_MIN);
+    char *pg = paged_page(pid, false);
+    size_t pos = leaf_lower_bound(pg, idx, INT_MIN);
+    for (;;) {
+        uint16_t cnt = page_count(pg);
+        for (; pos < cnt; ++pos) {
+            const char *s = leaf_slot(pg, pos);
+            if (key_cmp(idx, s) != 0) return;
+            dst.push_back(slot_value(s));
+        }
+        pid = page_link(pg);
+        if (!pid) return;
+        pg = paged_page(pid, false);
+        pos = 0;
+    }
+}
+
+static void paged_find(const string &idx) {
+    static vector<int> vals;
+    vals.clear();
+    paged_values(idx, vals);
+    print_values(vals.data(), vals.size());
+}
+
+static void paged_open(size_t pool_pages) {
+    pool_frames.assign(max<size_t>(pool_pages, 4), PoolFrame());
+    pool_mem.assign(pool_frames.size() * PAGE_SIZE, 0);
+    string path = paged_path();
+    paged_fp = fopen(path.c_str(), "r+b");
+    vector<char> hdr(PAGE_SIZE, 0);
+    if (paged_fp && fread(hdr.data(), 1, PAGE_SIZE, paged_fp) >= CHANGE_MAP_OFF && memcmp(hdr.data(), "BPT1", 4) == 0) {
+        memcpy(&pmeta.root, &hdr[4], 4);
+        memcpy(&pmeta.npages, &hdr[8], 4);
+        memcpy(&pmeta.height, &hdr[12], 4);
+        memcpy(&pmeta.entries, &hdr[16], 8);
+        memcpy(&change_stride, &hdr[24], 4);
+        memcpy(page_changes.data(), &hdr[CHANGE_MAP_OFF], page_changes.size());
+        return;
+    }
+    if (paged_fp) fclose(paged_fp);
+    paged_fp = fopen(path.c_str(), "w+b");
+    pmeta = PagedMeta();
+    change_stride = 0;
+    paged_alloc(0); // page 0 holds the meta block
+    pmeta.root = paged_alloc(PAGE_LEAF);
+}
+
+static void paged_close() {
+    if (!paged_fp) return;
+    for (uint32_t f = 0; f < pool_frames.size(); ++f) {
+        if (pool_frames[f].id != UINT32_MAX) paged_write_back(f);
+    }
+    char hdr[CHANGE_MAP_OFF];
+    memcpy(hdr, "BPT1", 4);
+    memcpy(hdr + 4, &pmeta.root, 4);
+    memcpy(hdr + 8, &pmeta.npages, 4);
+    memcpy(hdr + 12, &pmeta.height, 4);
+    memcpy(hdr + 16, &pmeta.entries, 8);
+    memcpy(hdr + 24, &change_stride, 4);
+    fseek(paged_fp, 0, SEEK_SET);
+    fwrite(hdr, 1, sizeof(hdr), paged_fp);
+    fwrite(page_changes.data(), 1, page_changes.size(), paged_fp);
+    fclose(paged_fp);
+    paged_fp = nullptr;
+}
+
+// External-memory build (--paged-import): converts the bucket files into pages.dat.
+// Each bucket is loaded alone, sorted and spilled as a run file; the runs are then
+// k-way merged into a bottom-up bulk load, so memory is one bucket plus the pool.
+static const size_t BULK_LEAF_FILL = LEAF_CAP * 9 / 10;
+static const size_t BULK_INNER_FILL = INNER_CAP * 9 / 10;
+
+struct BulkLevel {
+    uint32_t page = 0;
+    uint16_t count = 0;
+    bool open = false;
+    char first[SLOT_BYTES]; // lowest slot under the open node, pushed up when it closes
+};
+
+static vector<BulkLevel> bulk_levels;
+
+// Adds `child` (whose lowest slot is `first`) to inner level `lv`
+static void bulk_push(size_t lv, const char *first, uint32_t child) {
+    if (bulk_levels.size() <= lv) bulk_levels.resize(lv + 1);
+    if (bulk_levels[lv].open && bulk_levels[lv].count >= BULK_INNER_FILL) {
+        BulkLevel done = bulk_levels[lv];
+        bulk_levels[lv].open = false;
+        bulk_push(lv + 1, done.first, done.page);
+    }
+    BulkLevel &L = bulk_levels[lv];
+    if (!L.open) {
+        L.page = paged_alloc(PAGE_INNER);
+        L.count = 0;
+        L.open = true;
+        memcpy(L.first, first, SLOT_BYTES);
+        set_page_link(paged_page(L.page, true), child);
+        return;
+    }
+    char *pg = paged_page(L.page, true);
+    memcpy(inner_entry(pg, L.count), first, SLOT_BYTES);
+    memcpy(inner_entry(pg, L.count) + SLOT_BYTES, &child, 4);
+    set_page_count(pg, ++L.count);
+}
+
+// Run file record: [u32 klen][key][i32 value]
+struct RunReader {
+    FILE *f = nullptr;
+    string key;
+    int val = 0;
+    bool next() {
+        uint32_t klen;
+        if (fread(&klen, 4, 1, f) != 1) return false;
+        key.resize(klen);
+        return fread(&key[0], 1, klen, f) == klen && fread(&val, 4, 1, f) == 1;
+    }
+};
+
+static void paged_import_buckets(size_t pool_pages) {
+    vector<string> runs;
+    for (int b = 0; b < slot_count(); ++b) {
+        Bucket bk;
+        read_bucket(b, bk);
+        vector<const string*> keys; // plain records and shard directories
+        for (const auto &kv : bk.map) {
+            bool shard = logical_len(kv.first) < kv.first.size() && !is_shard_dir(kv.first);
+            if (!kv.second.empty() && !shard) keys.push_back(&kv.first);
+        }
+        sort(keys.begin(), keys.end(), [](const string *a, const string *c) { return *a < *c; });
+        string run = primary_dir() + "/run_" + to_string(b) + ".tmp";
+        FILE *f = fopen(run.c_str(), "wb");
+        if (!f) continue;
+        vector<int> vals;
+        for (const string *k : keys) {
+            uint32_t klen = (uint32_t)logical_len(*k);
+            vals.clear();
+            const Postings &rec = bk.map.find(*k)->second;
+            if (is_shard_dir(*k)) shard_values(bk, k->substr(0, klen), rec, vals);
+            else vals.assign(rec.begin(), rec.end());
+            for (int v : vals) {
+                fwrite(&klen, 4, 1, f);
+                fwrite(k->data(), 1, klen, f);
+                fwrite(&v, 4, 1, f);
+            }
+        }
+        fclose(f);
+        runs.push_back(run);
+    }
+
+    filesystem::remove(paged_path());
+    paged_open(pool_pages);
+    vector<RunReader> rd(runs.size());
+    auto cmp = [&](size_t a, size_t c) {
+        return rd[a].key != rd[c].key ? rd[a].key > rd[c].key : rd[a].val > rd[c].val;
+    };
+    priority_queue<size_t, vector<size_t>, decltype(cmp)> heap(cmp);
+    for (size_t i = 0; i < runs.size(); ++i) {
+        rd[i].f = fopen(runs[i].c_str(), "rb");
+        if (rd[i].f && rd[i].next()) heap.push(i);
+    }
+    uint32_t leaf = pmeta.root; // empty leaf allocated by paged_open
+    uint16_t cnt = 0;
+    char first[SLOT_BYTES], slot[SLOT_BYTES];
+    string last_key;
+    uint32_t last_ovf = 0;
+    while (!heap.empty()) {
+        size_t i = heap.top();
+        heap.pop();
+        if (cnt == BULK_LEAF_FILL) {
+            uint32_t next = paged_alloc(PAGE_LEAF);
+            set_page_link(paged_page(leaf, true), next);
+            bulk_push(0, first, leaf);
+            leaf = next;
+            cnt = 0;
+        }
+        const string &key = rd[i].key;
+        if (key.size() > PAGED_KEY_MAX && key != last_key) {
+            last_ovf = paged_write_overflow(key.data() + OVERFLOW_PREFIX, key.size() - OVERFLOW_PREFIX);
+            last_key = key;
+        }
+        make_slot(slot, key, rd[i].val, last_ovf);
+        char *pg = paged_page(leaf, true);
+        memcpy(leaf_slot(pg, cnt), slot, SLOT_BYTES);
+        if (!cnt) memcpy(first, slot, SLOT_BYTES);
+        set_page_count(pg, ++cnt);
+        ++pmeta.entries;
+        if (rd[i].next()) heap.push(i);
+    }
+    if (!bulk_levels.empty()) {
+        // Close the open nodes bottom-up; the last level standing is the root
+        bulk_push(0, first, leaf);
+        for (size_t lv = 0; lv + 1 < bulk_levels.size(); ++lv) {
+            BulkLevel done = bulk_levels[lv];
+            bulk_levels[lv].open = false;
+            bulk_push(lv + 1, done.first, done.page);
+        }
+        pmeta.root = bulk_levels.back().page;
+        pmeta.height = (uint32_t)bulk_levels.size() + 1;
+    }
+    for (size_t i = 0; i < runs.size(); ++i) {
+        if (rd[i].f) fclose(rd[i].f);
+        filesystem::remove(runs[i]);
+    }
+    paged_close();
+}
+
+// Drops an expired key before a mutation touches it; journaled so replay sees the reset
+static void purge_if_expired(Bucket &bk, const string &idx) {
+    if (!key_expired(bk, idx)) return;
+    bk.expiry.erase(idx);
+    bucket_drop(bk, idx);
+    bk.dirty = true;
+    journal_op(bk, 'X', idx, 0);
+}
+
+static void cmd_expire(const string &idx, int seconds) {
+    if (opt.paged) return; // TTLs live in bucket images only
+    int b = bucket_id(idx);
+    Bucket &bk = load_bucket(b);
+    purge_if_expired(bk, idx);
+    uint32_t deadline = seconds > 0 ? now_seconds() + (uint32_t)seconds : 0;
+    if (deadline) bk.expiry[idx] = deadline;
+    else if (!bk.expiry.erase(idx)) return;
+    bk.dirty = true;
+    journal_op(bk, 'E', idx, (int)deadline);
+}
+
+static void cmd_insert(const string &idx, int val) {
+    if (opt.paged) {
+        paged_insert(idx, val);
+        return;
+    }
+    int b = bucket_id(idx);
+    Bucket &bk = load_bucket(b);
+    purge_if_expired(bk, idx);
+    if (bucket_insert(bk, idx, val)) {
+        bk.dirty = true;
+        journal_op(bk, 'I', idx, val);
+    }
+}
+
+static void cmd_delete(const string &idx, int val) {
+    if (opt.paged) {
+        paged_delete(idx, val);
+        return;
+    }
+    int b = bucket_id(idx);
+    Bucket &bk = load_bucket(b);
+    purge_if_expired(bk, idx);
+    if (bucket_erase(bk, idx, val)) {
+        bk.dirty = true;
+        journal_op(bk, 'D', idx, val);
+    }
+}
+
+static void cmd_find(const string &idx) {
+    if (opt.paged) {
+        paged_find(idx);
+        return;
+    }
+    int b = bucket_id(idx);
+    Bucket &bk = load_bucket(b);
+    if (Postings *dir = shard_dir(bk, idx)) {
+        static vector<int> vals; // reused across finds
+        vals.clear();
+        if (!key_expired(bk, idx)) shard_values(bk, idx, *dir, vals);
+        print_values(vals.data(), vals.size());
+        return;
+    }
+    auto itIdx = bk.map.find(idx);
+    if (itIdx == bk.map.end() || itIdx->second.empty() || key_expired(bk, idx)) {
+        print_values(nullptr, 0);
+        return;
+    }
+    print_values(itIdx->second.data(), itIdx->second.size());
+}
+
+// Set queries over two posting lists (sorted, unique). Intersection gallops through the
+// longer list when the sizes are lopsided, finishing each probe with the dispatched
+// lower_bound kernel, and merges linearly otherwise; union is a linear merge.
+static const size_t GALLOP_RATIO = 16;
+
+static void intersect_sorted(const vector<int> &a, const vector<int> &b, vector<int> &dst) {
+    const vector<int> &small = a.size() <= b.size() ? a : b;
+    const vector<int> &large = a.size() <= b.size() ? b : a;
+    if (small.empty()) return;
+    if (large.size() / small.size() < GALLOP_RATIO) {
+        set_intersection(a.begin(), a.end(), b.begin(), b.end(), back_inserter(dst));
+        return;
+    }
+    size_t pos = 0, n = large.size();
+    for (int v : small) {
+        size_t step = 1;
+        while (pos + step < n && large[pos + step] < v) step <<= 1;
+        size_t lo = pos + (step >> 1), hi = min(n, pos + step + 1);
+        pos = lo + kern.lower_bound(large.data() + lo, hi - lo, v);
+        if (pos == n) return;
+        if (large[pos] == v) dst.push_back(v);
+    }
+}
+
+// Appends the live values of idx (a copy: loading the other operand may evict the bucket)
+static void key_values(const string &idx, vector<int> &dst) {
+    if (opt.paged) {
+        paged_values(idx, dst);
+        return;
+    }
+    Bucket &bk = load_bucket(bucket_id(idx));
+    if (key_expired(bk, idx)) return;
+    if (Postings *dir = shard_dir(bk, idx)) {
+        shard_values(bk, idx, *dir, dst);
+        return;
+    }
+    auto it = bk.map.find(idx);
+    if (it == bk.map.end()) return;
+    dst.insert(dst.end(), it->second.begin(), it->second.end());
+}
+
+static void combine_values(bool intersect, const vector<int> &a, const vector<int> &b, vector<int> &dst) {
+    if (intersect) intersect_sorted(a, b, dst);
+    else set_union(a.begin(), a.end(), b.begin(), b.end(), back_inserter(dst));
+}
+
+static void cmd_set_query(bool intersect, const string &x, const string &y) {
+    static vector<int> a, b, res;
+    a.clear();
+    b.clear();
+    res.clear();
+    key_values(x, a);
+    if (intersect && a.empty()) {
+        print_values(nullptr, 0);
+        return;
+    }
+    key_values(y, b);
+    combine_values(intersect, a, b, res);
+    print_values(res.data(), res.size());
+}
+
+// Parsed commands run through a window: one command by default, up to --lookahead N
+// with the optimizer below. Keys are namespace-qualified as they are read.
+enum CommandOp : uint8_t { OP_NONE, OP_INSERT, OP_DELETE, OP_FIND, OP_EXPIRE, OP_INTERSECT, OP_UNION };
+
+struct Command {
+    CommandOp op = OP_NONE;
+    int val = 0;
+    bool live = true;  // false: superseded by a later mutation of the same (key, value)
+    bool keep = false; // OP_FIND whose values later finds reuse
+    int32_t same = -1; // OP_FIND repeating the find at this window index
+    string key, other;
+};
+
+// A keep find's response: its values, and the bytes they printed as unless the buffer
+// was flushed midway (repeats then print the values again)
+struct WindowFound {
+    vector<int> vals;
+    string text;
+};
+
+struct WindowStats {
+    uint64_t windows = 0, collapsed = 0, coalesced = 0;
+};
+
+static vector<Command> window(1);
+static size_t window_len = 0;
+static vector<WindowFound> window_found; // by window index
+static WindowStats wstats;
+
+static void parse_command(Command &c, const string &cmd) {
+    c.live = true;
+    c.keep = false;
+    c.same = -1;
+    c.op = OP_NONE;
+    if (cmd == "insert" || cmd == "delete" || cmd == "expire") {
+        c.op = cmd[0] == 'i' ? OP_INSERT : cmd[0] == 'd' ? OP_DELETE : OP_EXPIRE;
+        in.integer(c.val);
+    } else if (cmd == "find") {
+        c.op = OP_FIND;
+    } else if (cmd == "intersect" || cmd == "union") {
+        c.op = cmd[0] == 'i' ? OP_INTERSECT : OP_UNION;
+        in.token(c.other);
+        if (cur_tenant) c.other = qualify(c.other);
+    }
+    if (cur_tenant) c.key = qualify(c.key);
+}
+
+// Whether idx carries a TTL deadline, which may pass between two finds of one window
+static bool key_has_deadline(const string &idx) {
+    if (opt.paged) return false;
+    const Bucket &bk = load_bucket(bucket_id(idx));
+    return !bk.expiry.empty() && bk.expiry.count(idx);
+}
+
+static void run_command(const Command &c, size_t at) {
+    switch (c.op) {
+    case OP_INSERT: {
+        LatencyTimer t(LAT_INSERT);
+        cmd_insert(c.key, c.val);
+        break;
+    }
+    case OP_DELETE: {
+        LatencyTimer t(LAT_DELETE);
+        cmd_delete(c.key, c.val);
+        break;
+    }
+    case OP_FIND: {
+        LatencyTimer t(LAT_FIND);
+        if (c.same >= 0 && key_has_deadline(c.key)) {
+            cmd_find(c.key);
+        } else if (c.same >= 0) {
+            const WindowFound &wf = window_found[c.same];
+            if (wf.text.empty()) print_values(wf.vals.data(), wf.vals.size());
+            else out.put(wf.text.data(), wf.text.size());
+        } else if (c.keep) {
+            WindowFound &wf = window_found[at];
+            wf.vals.clear();
+            wf.text.clear();
+            key_values(c.key, wf.vals);
+            size_t start = out.len;
+            uint64_t flushes = out.flushes;
+            print_values(wf.vals.data(), wf.vals.size());
+            if (out.flushes == flushes) wf.text.assign(out.buf + start, out.len - start);
+        } else {
+            cmd_find(c.key);
+        }
+        break;
+    }
+    case OP_EXPIRE: {
+        LatencyTimer t(LAT_EXPIRE);
+        cmd_expire(c.key, c.val);
+        break;
+    }
+    case OP_INTERSECT:
+    case OP_UNION: {
+        LatencyTimer t(LAT_SET_QUERY);
+        cmd_set_query(c.op == OP_INTERSECT, c.key, c.other);
+        break;
+    }
+    case OP_NONE:
+        break; // invalid command
+    }
+}
+
+// Lookahead optimizer: window commands are grouped by key (a set query joins both of
+// its keys' groups), and within a group
+// - of the mutations of one value with no find, expire or set query of the key between
+//   them, only the last runs: whatever the earlier ones did, the key then holds the
+//   value exactly when the last one is an insert. An insert/delete pair thus leaves
+//   just the delete, which is a no-op (no journal entry, nothing replicated) when the
+//   value was absent to begin with;
+// - a find with no surviving insert, delete or expire of the key since the previous
+//   find prints that find's values instead of looking the key up again, unless the
+//   key has a TTL deadline when the repeat runs: the deadline may have passed since,
+//   so such finds look the key up as usual.
+// Output is unchanged: every response is computed from the same key state as before.
+struct WindowRef {
+    const string *key;
+    uint32_t at;
+};
+
+struct WindowMutation {
+    int val;
+    uint32_t epoch, at; // epoch: reads of the key before this mutation
+};
+
+static vector<WindowRef> window_refs;
+static vector<WindowMutation> window_muts;
+
+static void collapse_mutations(size_t g, size_t e) {
+    window_muts.clear();
+    uint32_t epoch = 0;
+    for (size_t r = g; r < e; ++r) {
+        const Command &c = window[window_refs[r].at];
+        if (c.op == OP_INSERT || c.op == OP_DELETE) window_muts.push_back({c.val, epoch, window_refs[r].at});
+        else ++epoch;
+    }
+    if (window_muts.size() < 2) return;
+    sort(window_muts.begin(), window_muts.end(), [](const WindowMutation &a, const WindowMutation &b) {
+        return tie(a.val, a.epoch, a.at) < tie(b.val, b.epoch, b.at);
+    });
+    for (size_t m = 0; m + 1 < window_muts.size(); ++m) {
+        if (window_muts[m].val == window_muts[m + 1].val && window_muts[m].epoch == window_muts[m + 1].epoch) {
+            window[window_muts[m].at].live = false;
+            ++wstats.collapsed;
+        }
+    }
+}
+
+static void coalesce_finds(size_t g, size_t e) {
+    int32_t last = -1;
+    for (size_t r = g; r < e; ++r) {
+        uint32_t at = window_refs[r].at;
+        Command &c = window[at];
+        if (!c.live || c.op == OP_INTERSECT || c.op == OP_UNION) continue;
+        if (c.op != OP_FIND) {
+            last = -1;
+        } else if (last < 0) {
+            last = (int32_t)at;
+        } else {
+            c.same = last;
+            window[last].keep = true;
+            ++wstats.coalesced;
+        }
+    }
+}
+
+static void optimize_window() {
+    ++wstats.windows;
+    window_refs.clear();
+    for (uint32_t i = 0; i < window_len; ++i) {
+        const Command &c = window[i];
+        if (c.op == OP_NONE) continue;
+        window_refs.push_back({&c.key, i});
+        if (c.op == OP_INTERSECT || c.op == OP_UNION) window_refs.push_back({&c.other, i});
+    }
+    sort(window_refs.begin(), window_refs.end(), [](const WindowRef &a, const WindowRef &b) {
+        int cmp = a.key->compare(*b.key);
+        return cmp ? cmp < 0 : a.at < b.at;
+    });
+    for (size_t g = 0; g < window_refs.size();) {
+        size_t e = g + 1;
+        while (e < window_refs.size() && *window_refs[e].key == *window_refs[g].key) ++e;
+        collapse_mutations(g, e);
+        coalesce_finds(g, e);
+        g = e;
+    }
+}
+
+static void run_window() {
+    if (window_len > 1) optimize_window();
+    for (size_t i = 0; i < window_len; ++i) {
+        if (window[i].live) run_command(window[i], i);
+    }
+    window_len = 0;
+}
+
+// Router mode: workers run the ordinary command loop on pipes; the router keeps a FIFO of
+// the workers owing find responses and only ever blocks in poll(), so neither side can
+// wedge on a full pipe. Workers flush their output before blocking on input.
+static const size_t ROUTER_HIGH_WATER = 1 << 16;
+
+struct RouterWorker {
+    pid_t pid = -1;
+    int to = -1;   // command pipe, write end
+    int from = -1; // response pipe, read end
+    string outbuf; // commands not yet written
+    size_t outpos = 0;
+    string inbuf;  // responses not yet emitted
+    size_t inpos = 0;
+};
+
+// A response owed to the output, in input order: worker k's next line, or for a set query
+// whose operands live on two workers, the combination of k's and k2's next find lines
+struct PendingResponse {
+    int k;
+    int k2 = -1;
+    bool intersect = false;
+};
+
+static vector<RouterWorker> workers;
+static deque<PendingResponse> pending_finds;
+
+// Forks the workers; returns in the parent, and in each child with opt.worker set
+static void spawn_workers(int n) {
+    for (int k = 0; k < n; ++k) {
+        int cmd_pipe[2], resp_pipe[2];
+        if (pipe(cmd_pipe) || pipe(resp_pipe)) {
+            perror("pipe");
+            exit(1);
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            dup2(cmd_pipe[0], 0);
+            dup2(resp_pipe[1], 1);
+            close(cmd_pipe[0]); close(cmd_pipe[1]);
+            close(resp_pipe[0]); close(resp_pipe[1]);
+            // Earlier workers' pipe ends would otherwise keep them from seeing EOF
+            for (const RouterWorker &w : workers) { close(w.to); close(w.from); }
+            workers.clear();
+            opt.worker = true;
+            opt.worker_index = k;
+            opt.encode = ENC_TEXT; // the router encodes the merged stream
+            return;
+        }
+        close(cmd_pipe[0]);
+        close(resp_pipe[1]);
+        RouterWorker w;
+        w.pid = pid;
+        w.to = cmd_pipe[1];
+        w.from = resp_pipe[0];
+        fcntl(w.to, F_SETFL, fcntl(w.to, F_GETFL) | O_NONBLOCK);
+        fcntl(w.from, F_SETFL, fcntl(w.from, F_GETFL) | O_NONBLOCK);
+        workers.push_back(std::move(w));
+    }
+}
+
+// Parses one response line [p, end) back into values
+static void parse_values(const char *p, const char *end, vector<int> &dst) {
+    while (p < end) {
+        char *next;
+        long v = strtol(p, &next, 10);
+        if (next == p) return; // end of line, or "null"
+        dst.push_back((int)v);
+        p = next;
+    }
+}
+
+static void router_emit() {
+    static vector<int> a, b, res;
+    while (!pending_finds.empty()) {
+        const PendingResponse &pr = pending_finds.front();
+        RouterWorker &w = workers[pr.k];
+        size_t nl = w.inbuf.find('\n', w.inpos);
+        if (nl == string::npos) break;
+        if (pr.k2 < 0 && opt.encode != ENC_DELTA) {
+            out.put(w.inbuf.data() + w.inpos, nl + 1 - w.inpos);
+        } else if (pr.k2 < 0) { // workers answer in text
+            a.clear();
+            parse_values(w.inbuf.c_str() + w.inpos, w.inbuf.c_str() + nl, a);
+            print_values(a.data(), a.size());
+        } else {
+            RouterWorker &w2 = workers[pr.k2];
+            size_t nl2 = w2.inbuf.find('\n', w2.inpos);
+            if (nl2 == string::npos) break;
+            a.clear();
+            b.clear();
+            res.clear();
+            parse_values(w.inbuf.c_str() + w.inpos, w.inbuf.c_str() + nl, a);
+            parse_values(w2.inbuf.c_str() + w2.inpos, w2.inbuf.c_str() + nl2, b);
+            combine_values(pr.intersect, a, b, res);
+            print_values(res.data(), res.size());
+            w2.inpos = nl2 + 1;
+        }
+        w.inpos = nl + 1;
+        pending_finds.pop_front();
+    }
+    for (RouterWorker &w : workers) {
+        if (w.inpos && w.inpos * 2 >= w.inbuf.size()) {
+            w.inbuf.erase(0, w.inpos);
+            w.inpos = 0;
+        }
+    }
+}
+
+// Moves bytes both ways until every command buffer is under `limit` bytes
+// (limit 0: fully written) and, when `finish` is set, every response has arrived.
+static void router_pump(size_t limit, bool finish) {
+    vector<pollfd> fds;
+    for (;;) {
+        router_emit();
+        bool busy = finish && !pending_finds.empty();
+        for (const RouterWorker &w : workers) busy = busy || w.outbuf.size() - w.outpos > limit;
+        if (!busy) return;
+        fds.clear();
+        bool open = false;
+        for (const RouterWorker &w : workers) {
+            fds.push_back({w.outbuf.size() > w.outpos ? w.to : -1, POLLOUT, 0});
+            fds.push_back({w.from, POLLIN, 0});
+            open = open || w.from >= 0;
+        }
+        if (!open) {
+            fprintf(stderr, "router: workers exited with finds unanswered\n");
+            exit(1);
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            exit(1);
+        }
+        for (size_t k = 0; k < workers.size(); ++k) {
+            RouterWorker &w = workers[k];
+            if (fds[2 * k].revents) {
+                ssize_t put = write(w.to, w.outbuf.data() + w.outpos, w.outbuf.size() - w.outpos);
+                if (put < 0 && errno != EAGAIN && errno != EINTR) {
+                    perror("router: write");
+                    exit(1);
+                }
+                if (put > 0) w.outpos += (size_t)put;
+                if (w.outpos == w.outbuf.size()) {
+                    w.outbuf.clear();
+                    w.outpos = 0;
+                }
+            }
+            if (fds[2 * k + 1].revents) {
+                char chunk[1 << 15];
+                ssize_t got = read(w.from, chunk, sizeof(chunk));
+                if (got > 0) {
+                    w.inbuf.append(chunk, (size_t)got);
+                } else if (got == 0) {
+                    close(w.from);
+                    w.from = -1;
+                }
+            }
+        }
+    }
+}
+
+static void router_send(int k, const string &line) {
+    workers[k].outbuf.append(line);
+    if (workers[k].outbuf.size() - workers[k].outpos > ROUTER_HIGH_WATER) router_pump(ROUTER_HIGH_WATER / 2, false);
+}
+
+static void run_router(long n) {
+    signal(SIGPIPE, SIG_IGN); // a dead worker surfaces as a write error instead
+    string cmd, idx, other, line;
+    int val = 0;
+    for (long i = 0; i < n; ++i) {
+        if (!in.token(cmd) || !in.token(idx)) break;
+        if (cmd == "intersect" || cmd == "union") {
+            in.token(other);
+            int k = bucket_id(qualify(idx)) % (int)workers.size();
+            int k2 = bucket_id(qualify(other)) % (int)workers.size();
+            PendingResponse pr{k};
+            if (k == k2) {
+                router_send(k, cmd + ' ' + idx + ' ' + other + '\n');
+            } else {
+                // operands on two workers: fetch both lists and combine here
+                pr.k2 = k2;
+                pr.intersect = cmd == "intersect";
+                router_send(k, "find " + idx + '\n');
+                router_send(k2, "find " + other + '\n');
+            }
+            pending_finds.push_back(pr);
+            continue;
+        }
+        bool has_val = cmd == "insert" || cmd == "delete" || cmd == "expire";
+        if (has_val) in.integer(val);
+        line.assign(cmd);
+        line.push_back(' ');
+        line.append(idx);
+        if (has_val) {
+            line.push_back(' ');
+            line.append(to_string(val));
+        }
+        line.push_back('\n');
+        if (cmd == "use") {
+            use_namespace(idx);
+            for (int k = 0; k < (int)workers.size(); ++k) router_send(k, line);
+            continue;
+        }
+        int k = bucket_id(qualify(idx)) % (int)workers.size();
+        if (cmd == "find") pending_finds.push_back(PendingResponse{k});
+        router_send(k, line);
+    }
+    router_pump(0, false);
+    for (RouterWorker &w : workers) {
+        close(w.to);
+        w.to = -1;
+    }
+    router_pump(0, true);
+    for (RouterWorker &w : workers) {
+        if (w.from >= 0) close(w.from);
+        int status;
+        waitpid(w.pid, &status, 0);
+    }
+}
+
+// Metrics (--metrics FILE): Prometheus text exposition, rewritten every
+// --metrics-interval seconds (checked between commands) and at exit. Each dump goes
+// through a temp file and a rename, so a local scraper, e.g. the node exporter's textfile
+// collector, never sees a torn file. Router workers write FILE.<worker>.
+static const long METRICS_CHECK_EVERY = 256; // commands between clock reads
+static uint64_t metrics_started = 0, metrics_last = 0;
+
+// Rough heap footprint of a cached bucket: strings, vectors and hash nodes
+static uint64_t bucket_footprint(const Bucket &bk) {
+#ifdef FILESTORE_ART
+    uint64_t bytes = sizeof(Bucket) + bk.map.node_bytes();
+#else
+    uint64_t bytes = sizeof(Bucket) + bk.map.bucket_count() * sizeof(void*);
+#endif
+    for (const auto &kv : bk.map) {
+        bytes += 2 * sizeof(void*) + sizeof(kv) + kv.first.capacity() + posting_capacity(kv.second.capacity()) * sizeof(int);
+    }
+    bytes += bk.pending.capacity();
+    return bytes;
+}
+
+static uint64_t posting_payload_bytes() {
+    uint64_t bytes = 0;
+    for (const auto &e : cache) {
+        for (const auto &kv : e.second.map) bytes += kv.second.size() * sizeof(int);
+    }
+    return bytes;
+}
+
+// --stats in bucket mode: posting-list memory against the values it holds, then one line
+// per slabbed size class
+static void print_posting_stats() {
+    PostingUsage u = posting_usage();
+    uint64_t payload = posting_payload_bytes();
+    fprintf(stderr, "postings: payload=%llu live=%llu held=%llu slabs=%llu overhead=%.1f%%\n",
+            (unsigned long long)payload, (unsigned long long)u.live_bytes, (unsigned long long)u.held_bytes,
+            (unsigned long long)u.slabs, payload ? 100.0 * (double)(u.held_bytes - min(u.held_bytes, payload)) / (double)payload : 0.0);
+    lock_guard<mutex> lock(posting_pool.mu);
+    for (int c = 1; c < POSTING_CLASSES; ++c) {
+        const PostingClassStats &st = posting_pool.stats[c];
+        if (!st.slabs) continue;
+        fprintf(stderr, "postings: class=%zu slabs=%llu live=%llu fill=%.1f%%\n", posting_class_cap(c),
+                (unsigned long long)st.slabs, (unsigned long long)st.live,
+                100.0 * (double)st.live / (double)(st.slabs * posting_slab_blocks(c)));
+    }
+}
+
+static void write_metrics() {
+    string path = opt.metrics;
+    if (opt.worker) path += "." + to_string(opt.worker_index);
+    string tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (!fp) return;
+    auto family = [fp](const char *name, const char *type, const char *help) {
+        fprintf(fp, "# HELP filestore_%s %s\n# TYPE filestore_%s %s\n", name, help, name, type);
+    };
+    auto sample = [fp](const char *name, double v) { fprintf(fp, "filestore_%s %.15g\n", name, v); };
+    uint64_t misses = counters.events[LAT_LOAD_MISS];
+    uint64_t resident = 0, dirty = 0;
+    for (const auto &e : cache) {
+        uint64_t bytes = bucket_footprint(e.second);
+        resident += bytes;
+        if (e.second.dirty) dirty += bytes;
+    }
+    family("uptime_seconds", "gauge", "Seconds since the process started.");
+    sample("uptime_seconds", (double)(lat_now() - metrics_started) / 1e9);
+    family("commands_total", "counter", "Commands executed by kind.");
+    for (int k = LAT_INSERT; k <= LAT_SET_QUERY; ++k) {
+        fprintf(fp, "filestore_commands_total{op=\"%s\"} %llu\n", LAT_NAMES[k], (unsigned long long)counters.events[k]);
+    }
+    if (!opt.paged) {
+        family("cache_hits_total", "counter", "Bucket lookups served from the cache.");
+        sample("cache_hits_total", (double)counters.cache_hits);
+        family("cache_misses_total", "counter", "Bucket lookups that loaded the bucket from disk.");
+        sample("cache_misses_total", (double)misses);
+        family("cache_hit_ratio", "gauge", "Cache hits over all bucket lookups so far.");
+        sample("cache_hit_ratio", counters.cache_hits + misses ? (double)counters.cache_hits / (double)(counters.cache_hits + misses) : 0.0);
+        family("cache_evictions_total", "counter", "Buckets evicted from the cache.");
+        sample("cache_evictions_total", (double)counters.evictions);
+        family("cache_buckets", "gauge", "Buckets currently cached.");
+        sample("cache_buckets", (double)cache.size());
+        family("cache_resident_bytes", "gauge", "Estimated heap bytes held by cached buckets.");
+        sample("cache_resident_bytes", (double)resident);
+        family("cache_dirty_bytes", "gauge", "Estimated heap bytes of cached buckets awaiting a flush.");
+        sample("cache_dirty_bytes", (double)dirty);
+        PostingUsage pu = posting_usage();
+        family("posting_payload_bytes", "gauge", "Bytes of values held by cached posting lists.");
+        sample("posting_payload_bytes", (double)posting_payload_bytes());
+        family("posting_live_bytes", "gauge", "Bytes of size-class blocks in use by posting lists.");
+        sample("posting_live_bytes", (double)pu.live_bytes);
+        family("posting_held_bytes", "gauge", "Heap bytes held for posting lists (slabs and large blocks).");
+        sample("posting_held_bytes", (double)pu.held_bytes);
+        family("posting_slabs", "gauge", "Posting-list slabs allocated.");
+        sample("posting_slabs", (double)pu.slabs);
+        family("flushes_total", "counter", "Bucket flushes by kind.");
+        fprintf(fp, "filestore_flushes_total{kind=\"append\"} %llu\n", (unsigned long long)counters.flush_appends.load());
+        fprintf(fp, "filestore_flushes_total{kind=\"rewrite\"} %llu\n", (unsigned long long)counters.flush_rewrites.load());
+        family("bucket_bytes", "gauge", "On-disk size of each bucket file.");
+        for (int b = 0; b < slot_count(); ++b) {
+            error_code ec;
+            uintmax_t size = filesystem::file_size(locate_bucket(b), ec);
+            if (!ec) fprintf(fp, "filestore_bucket_bytes{bucket=\"%d\"} %llu\n", b, (unsigned long long)size);
+        }
+    } else {
+        family("pool_fetches_total", "counter", "Logical page accesses.");
+        sample("pool_fetches_total", (double)pstats.fetches);
+        family("pool_reads_total", "counter", "Buffer pool misses read from disk.");
+        sample("pool_reads_total", (double)pstats.reads);
+        family("pool_writes_total", "counter", "Dirty pages written back.");
+        sample("pool_writes_total", (double)pstats.writes);
+        family("pages", "gauge", "Pages in pages.dat.");
+        sample("pages", (double)pmeta.npages);
+    }
+    family("read_bytes_total", "counter", "Bytes read from bucket files and pages.dat.");
+    sample("read_bytes_total", (double)(counters.bytes_read.load() + pstats.reads * PAGE_SIZE));
+    family("written_bytes_total", "counter", "Bytes written to bucket files and pages.dat.");
+    sample("written_bytes_total", (double)(counters.bytes_written.load() + pstats.writes * PAGE_SIZE));
+    fclose(fp);
+    error_code ec;
+    filesystem::rename(tmp, path, ec);
+}
+
+// force: dump now regardless of the interval (exit, end of a standby session)
+static void metrics_tick(bool force) {
+    if (opt.metrics.empty()) return;
+    uint64_t now = lat_now();
+    if (!force && now - metrics_last < (uint64_t)(opt.metrics_interval * 1e9)) return;
+    metrics_last = now;
+    write_metrics();
+}
+
+// Standby (--standby SOCK): serves one primary connection at a time, applying each
+// frame's entries through the normal engine paths (so it keeps its own journal), and
+// flushes when the primary disconnects. SIGINT/SIGTERM stop it after a final flush.
+static volatile sig_atomic_t standby_stop = 0;
+
+static void flush_all_buckets();
+
+static void standby_apply(const char *p, const char *end) {
+    string key;
+    while (p < end) {
+        char op = *p++;
+        uint32_t klen;
+        if (!get_varint(p, end, klen) || (size_t)(end - p) < (size_t)klen + 4) return;
+        key.assign(p, klen);
+        int val;
+        memcpy(&val, p + klen, 4);
+        p += klen + 4;
+        if (opt.paged) {
+            if (op == 'I') paged_insert(key, val);
+            else if (op == 'D') paged_delete(key, val);
+            continue;
+        }
+        Bucket &bk = load_bucket(bucket_id(key));
+        if (apply_log_entry(bk, op, key, val)) {
+            bk.dirty = true;
+            journal_op(bk, op, key, val);
+        }
+    }
+}
+
+static bool read_full(int fd, char *p, size_t n) {
+    while (n) {
+        ssize_t got = read(fd, p, n);
+        if (got < 0 && errno == EINTR && !standby_stop) continue;
+        if (got <= 0) return false;
+        p += got;
+        n -= (size_t)got;
+    }
+    return true;
+}
+
+static void run_standby(const string &path) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = [](int) { standby_stop = 1; };
+    sigaction(SIGINT, &sa, nullptr); // no SA_RESTART: accept/read return EINTR
+    sigaction(SIGTERM, &sa, nullptr);
+    sockaddr_un addr;
+    int lfd = unix_socket(path, addr);
+    unlink(path.c_str());
+    if (lfd < 0 || bind(lfd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) || listen(lfd, 1)) {
+        perror("standby: listen");
+        exit(1);
+    }
+    string frame;
+    while (!standby_stop) {
+        int fd = accept(lfd, nullptr, nullptr);
+        if (fd < 0) continue;
+        uint32_t bytes;
+        while (read_full(fd, reinterpret_cast<char*>(&bytes), 4)) {
+            if (bytes > REPL_FRAME_MAX) {
+                fprintf(stderr, "standby: %u-byte frame over the limit, connection dropped\n", bytes);
+                break;
+            }
+            frame.resize(bytes);
+            if (!read_full(fd, &frame[0], bytes)) break;
+            standby_apply(frame.data(), frame.data() + frame.size());
+            metrics_tick(false);
+        }
+        close(fd);
+        flush_all_buckets();
+        metrics_tick(true);
+    }
+    close(lfd);
+    unlink(path.c_str());
+}
+
+// Exit-time flush; with several data directories each one gets its own writer thread
+static void flush_all_buckets() {
+    vector<vector<pair<int, Bucket*>>> per_dir(opt.data_dirs.size());
+    for (int b : lru) {
+        auto it = cache.find(b);
+        if (it != cache.end() && it->second.dirty) per_dir[bucket_dir_index(b)].emplace_back(b, &it->second);
+    }
+    auto flush_list = [](const vector<pair<int, Bucket*>> &list) {
+        for (const auto &e : list) flush_bucket_to_disk(e.first, *e.second);
+    };
+    if (per_dir.size() == 1) {
+        flush_list(per_dir[0]);
+        return;
+    }
+    vector<thread> writers;
+    for (const auto &list : per_dir) {
+        if (!list.empty()) writers.emplace_back(flush_list, cref(list));
+    }
+    for (auto &t : writers) t.join();
+}
+
+// --rebalance: loads every bucket stored outside its ring directory, one reader thread
+// per source directory, so the exit-time flush moves them all in this run.
+static void rebalance_buckets() {
+    vector<vector<int>> per_src(opt.data_dirs.size());
+    for (int b = 0; b < slot_count(); ++b) {
+        string path = locate_bucket(b);
+        if (path == bucket_path(b)) continue;
+        for (size_t d = 0; d < opt.data_dirs.size(); ++d) {
+            if (path == bucket_file(opt.data_dirs[d], b)) per_src[d].push_back(b);
+        }
+    }
+    vector<Bucket> loaded(slot_count());
+    vector<thread> readers;
+    for (const auto &list : per_src) {
+        if (list.empty()) continue;
+        readers.emplace_back([&loaded, &list] {
+            for (int b : list) read_bucket(b, loaded[b]);
+        });
+    }
+    for (auto &t : readers) t.join();
+    for (const auto &list : per_src) {
+        for (int b : list) {
+            if (cache.count(b)) continue;
+            evict_if_needed();
+            cache.emplace(b, std::move(loaded[b]));
+            touch_lru(b);
+        }
+    }
+}
+
+// Incremental backups: DIR/superblock lists every retained point with, per bucket, the
+// generation (point directory) holding its copy and the size/mtime it was taken at.
+//   FSB1
+//   point <id> <unix time> <bucket count> <pages.dat page count, -1 if none> <pages full>
+//   bk <bucket> <generation> <size> <mtime>
+// DIR/<id>/bk_<b>.dat holds changed buckets; DIR/<id>/pages.delta holds [u32 id][page]
+// records, all pages when "pages full" is set and otherwise the change-map ranges.
+struct BackupFile {
+    int bucket;
+    uint32_t gen;
+    uint64_t size;
+    long long mtime;
+};
+
+struct BackupPoint {
+    uint32_t id = 0;
+    long long time = 0;
+    vector<BackupFile> files;
+    long long npages = -1;
+    int pages_full = 0;
+};
+
+static vector<BackupPoint> read_superblock(const string &dir) {
+    vector<BackupPoint> points;
+    FILE *fp = fopen((dir + "/superblock").c_str(), "r");
+    if (!fp) return points;
+    char magic[8];
+    if (fscanf(fp, "%7s", magic) == 1 && strcmp(magic, "FSB1") == 0) {
+        BackupPoint pt;
+        size_t nfiles;
+        while (fscanf(fp, " point %u %lld %zu %lld %d", &pt.id, &pt.time, &nfiles, &pt.npages, &pt.pages_full) == 5) {
+            pt.files.resize(nfiles);
+            for (BackupFile &f : pt.files) {
+                if (fscanf(fp, " bk %d %u %llu %lld", &f.bucket, &f.gen, (unsigned long long *)&f.size, &f.mtime) != 4) {
+                    fclose(fp);
+                    return points;
+                }
+            }
+            points.push_back(pt);
+        }
+    }
+    fclose(fp);
+    return points;
+}
+
+static void write_superblock(const string &dir, const vector<BackupPoint> &points) {
+    string tmp = dir + "/superblock.tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (!fp) return;
+    fprintf(fp, "FSB1\n");
+    for (const BackupPoint &pt : points) {
+        fprintf(fp, "point %u %lld %zu %lld %d\n", pt.id, pt.time, pt.files.size(), pt.npages, pt.pages_full);
+        for (const BackupFile &f : pt.files) {
+            fprintf(fp, "bk %d %u %llu %lld\n", f.bucket, f.gen, (unsigned long long)f.size, f.mtime);
+        }
+    }
+    fclose(fp);
+    filesystem::rename(tmp, dir + "/superblock");
+}
+
+// Ships pages.dat into pt_dir/pages.delta and resets the live change map.
+// Returns the page count, or -1 when there is no paged store.
+static long long backup_pages(const string &pt_dir, bool &full) {
+    FILE *src = fopen(paged_path().c_str(), "r+b");
+    if (!src) return -1;
+    vector<char> meta(PAGE_SIZE, 0);
+    if (fread(meta.data(), 1, PAGE_SIZE, src) < CHANGE_MAP_OFF || memcmp(meta.data(), "BPT1", 4) != 0) {
+        fclose(src);
+        return -1;
+    }
+    uint32_t npages, stride;
+    memcpy(&npages, &meta[8], 4);
+    memcpy(&stride, &meta[24], 4);
+    full = full || !stride;
+    const uint8_t *map = reinterpret_cast<const uint8_t*>(&meta[CHANGE_MAP_OFF]);
+    FILE *dst = fopen((pt_dir + "/pages.delta").c_str(), "wb");
+    vector<char> pg(PAGE_SIZE);
+    for (uint32_t id = 0; id < npages; ++id) {
+        // the meta page changes on every close, so it always ships
+        bool changed = full || id == 0 || (map[id / stride >> 3] >> (id / stride & 7) & 1);
+        if (!changed) continue;
+        fseek(src, (long)id * (long)PAGE_SIZE, SEEK_SET);
+        if (fread(pg.data(), 1, PAGE_SIZE, src) != PAGE_SIZE) memset(pg.data(), 0, PAGE_SIZE);
+        fwrite(&id, 4, 1, dst);
+        fwrite(pg.data(), 1, PAGE_SIZE, dst);
+    }
+    fclose(dst);
+    stride = 1;
+    memset(&meta[CHANGE_MAP_OFF], 0, PAGE_SIZE - CHANGE_MAP_OFF);
+    memcpy(&meta[24], &stride, 4);
+    fseek(src, 24, SEEK_SET);
+    fwrite(&meta[24], 1, PAGE_SIZE - 24, src);
+    fclose(src);
+    return npages;
+}
+
+// Adds one point: buckets whose size or mtime moved since the previous point are copied
+// and take this point's generation; unchanged buckets keep pointing at their old copy.
+static void run_backup(const string &dir) {
+    vector<BackupPoint> points = read_superblock(dir);
+    BackupPoint pt;
+    pt.id = points.empty() ? 0 : points.back().id + 1;
+    pt.time = (long long)time(nullptr);
+    string pt_dir = dir + "/" + to_string(pt.id);
+    filesystem::create_directories(pt_dir);
+    error_code lec;
+    filesystem::copy_file(layout_path(), pt_dir + "/layout", filesystem::copy_options::overwrite_existing, lec);
+    map<int, BackupFile> prev;
+    Layout last;
+    if (!points.empty()) read_layout(dir + "/" + to_string(points.back().id) + "/layout", last);
+    // slot numbers only name the same files under the same layout
+    if (!points.empty() && last.from == layout.from && last.to == layout.to && last.migrated == layout.migrated) {
+        for (const BackupFile &f : points.back().files) prev[f.bucket] = f;
+    }
+    size_t copied = 0;
+    for (int b = 0; b < slot_count(); ++b) {
+        string path = locate_bucket(b);
+        error_code ec;
+        uint64_t size = filesystem::file_size(path, ec);
+        if (ec) continue;
+        BackupFile f{b, pt.id, size, (long long)filesystem::last_write_time(path, ec).time_since_epoch().count()};
+        auto it = prev.find(b);
+        if (it != prev.end() && it->second.size == f.size && it->second.mtime == f.mtime) {
+            f.gen = it->second.gen;
+        } else {
+            filesystem::copy_file(path, bucket_file(pt_dir, b), filesystem::copy_options::overwrite_existing, ec);
+            if (ec) {
+                fprintf(stderr, "backup: %s: %s\n", path.c_str(), ec.message().c_str());
+                return;
+            }
+            ++copied;
+        }
+        pt.files.push_back(f);
+    }
+    bool full = points.empty() || points.back().npages < 0;
+    pt.npages = backup_pages(pt_dir, full);
+    pt.pages_full = full;
+    points.push_back(pt);
+    write_superblock(dir, points);
+    if (opt.stats) {
+        fprintf(stderr, "backup: point=%u buckets=%zu copied=%zu pages=%lld\n", pt.id, pt.files.size(), copied, pt.npages);
+    }
+}
+
+// Rebuilds the data directories as of point `point`, or the last point taken at or
+// before `at` when point < 0.
+static void run_restore(const string &dir, long point, long long at) {
+    vector<BackupPoint> points = read_superblock(dir);
+    long k = -1;
+    for (size_t i = 0; i < points.size(); ++i) {
+        if (point >= 0 ? points[i].id == (uint32_t)point : points[i].time <= at) k = (long)i;
+    }
+    if (k < 0) {
+        fprintf(stderr, "restore: no such point in %s\n", dir.c_str());
+        exit(1);
+    }
+    const BackupPoint &pt = points[k];
+    for (int b = 0; b < slot_count(); ++b) {
+        error_code ec;
+        for (const string &d : opt.data_dirs) filesystem::remove(bucket_file(d, b), ec);
+    }
+    read_layout(dir + "/" + to_string(pt.id) + "/layout", layout); // the point's layout
+    write_layout();
+    vector<const BackupFile*> by_bucket(slot_count(), nullptr);
+    for (const BackupFile &f : pt.files) {
+        if (f.bucket < slot_count()) by_bucket[f.bucket] = &f;
+    }
+    for (int b = 0; b < slot_count(); ++b) {
+        error_code ec;
+        if (!by_bucket[b]) continue;
+        string src = bucket_file(dir + "/" + to_string(by_bucket[b]->gen), b);
+        filesystem::copy_file(src, bucket_path(b), filesystem::copy_options::overwrite_existing, ec);
+        if (ec) {
+            fprintf(stderr, "restore: %s: %s\n", src.c_str(), ec.message().c_str());
+            exit(1);
+        }
+    }
+    string pages = paged_path();
+    error_code ec;
+    filesystem::remove(pages, ec);
+    if (pt.npages < 0) return;
+    // replay deltas from the last full copy up to this point
+    long first = k;
+    while (first > 0 && !points[first].pages_full) --first;
+    FILE *dst = fopen(pages.c_str(), "w+b");
+    vector<char> pg(PAGE_SIZE);
+    for (long i = first; i <= k; ++i) {
+        FILE *src = fopen((dir + "/" + to_string(points[i].id) + "/pages.delta").c_str(), "rb");
+        if (!src) continue;
+        uint32_t id;
+        while (fread(&id, 4, 1, src) == 1 && fread(pg.data(), 1, PAGE_SIZE, src) == PAGE_SIZE) {
+            fseek(dst, (long)id * (long)PAGE_SIZE, SEEK_SET);
+            fwrite(pg.data(), 1, PAGE_SIZE, dst);
+        }
+        fclose(src);
+    }
+    uint32_t stride = 0; // the restored file's change map is stale: next backup is full
+    fseek(dst, 24, SEEK_SET);
+    fwrite(&stride, 4, 1, dst);
+    fclose(dst);
+    filesystem::resize_file(pages, (uintmax_t)pt.npages * PAGE_SIZE, ec);
+}
+
+// fsck (--fsck [--repair]): checks the bucket files one at a time (header, record bounds,
+// value order and uniqueness, duplicate keys, key placement against bucket_id, journal)
+// and pages.dat page by page. The loader trusts its input, so records are re-walked here
+// with every check. --repair rewrites each damaged bucket from the records that pass:
+// value lists are re-sorted, duplicates merged, misplaced keys moved to their own bucket
+// and a torn journal tail dropped. pages.dat is only checked; rebuild it with
+// --paged-import from repaired bucket files.
+static const size_t FSCK_SHOWN = 20; // problems printed per file
+
+struct FsckFile {
+    string name;
+    vector<string> problems;
+    size_t records = 0;
+
+    void note(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+        char msg[256];
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        va_end(ap);
+        problems.emplace_back(msg);
+    }
+    bool report() const {
+        if (problems.empty()) return false;
+        printf("%s: %zu problem(s), %zu record(s) read\n", name.c_str(), problems.size(), records);
+        for (size_t i = 0; i < problems.size() && i < FSCK_SHOWN; ++i) printf("  %s\n", problems[i].c_str());
+        if (problems.size() > FSCK_SHOWN) printf("  ... %zu more\n", problems.size() - FSCK_SHOWN);
+        return true;
+    }
+};
+
+struct MovedKey {
+    string key;
+    Postings vals;
+    uint32_t deadline;
+};
+
+static string fsck_show(const string &key) {
+    string shown = key.size() > 40 ? key.substr(0, 40) + "..." : key;
+    for (char &c : shown) {
+        if (c == NS_SEP) c = ':';
+        else if ((unsigned char)c < ' ' || (unsigned char)c >= 0x7F) c = '?';
+    }
+    return shown;
+}
+
+// Adds a checked record to bucket b's salvage, or to `moved` when it hashes elsewhere
+static void fsck_keep(int b, string key, Postings vals, uint32_t deadline, Bucket &out, vector<MovedKey> &moved,
+                      FsckFile &ff) {
+    for (char c : key) {
+        if ((unsigned char)c <= ' ' && c != NS_SEP && c != SHARD_SEP) {
+            ff.note("key %s: contains a control or blank byte, dropped", fsck_show(key).c_str());
+            return;
+        }
+    }
+    if (key.empty()) {
+        ff.note("empty key, dropped");
+        return;
+    }
+    if (adjacent_find(vals.begin(), vals.end(), greater_equal<int>()) != vals.end()) {
+        ff.note("key %s: values out of order or repeated", fsck_show(key).c_str());
+        sort(vals.begin(), vals.end());
+        vals.erase(unique(vals.begin(), vals.end()), vals.end());
+    }
+    if (b >= layout.from && bucket_id(key) < layout.from) {
+        ff.note("key %s: copy left by an interrupted reshard step, dropped", fsck_show(key).c_str());
+        return;
+    }
+    if (bucket_id(key) != b) {
+        ff.note("key %s: belongs in bucket %d", fsck_show(key).c_str(), bucket_id(key));
+        moved.push_back({std::move(key), std::move(vals), deadline});
+        return;
+    }
+    auto it = out.map.find(key);
+    if (it != out.map.end()) {
+        ff.note("key %s: duplicate record, merged", fsck_show(key).c_str());
+        Postings merged;
+        set_union(it->second.begin(), it->second.end(), vals.begin(), vals.end(), back_inserter(merged));
+        it->second.swap(merged);
+        return;
+    }
+    if (deadline) out.expiry[logical_key(key)] = deadline;
+    if (is_shard_dir(key)) out.shards = true;
+    out.map.emplace(std::move(key), std::move(vals));
+}
+
+// Re-walks base records like parse_records, checking each; false when the walk had to stop
+static bool fsck_records(const char *p, const char *end, unsigned char flags, bool delta, int b, Bucket &out,
+                         vector<MovedKey> &moved, FsckFile &ff) {
+    const char *start = p;
+    bool ttl = flags & BK_FLAG_TTL;
+    while (p < end) {
+        size_t at = (size_t)(p - start);
+        uint32_t klen;
+        if (!get_klen(p, end, flags & BK_FLAG_VARINT_KLEN, klen)) {
+            ff.note("record at +%zu: truncated key length", at);
+            return false;
+        }
+        bool has_ttl = ttl && (klen & 1);
+        if (ttl) klen >>= 1;
+        if ((size_t)(end - p) < (size_t)klen + 4 + (has_ttl ? 4 : 0)) {
+            ff.note("record at +%zu: key length %u runs past the image", at, klen);
+            return false;
+        }
+        string key(p, klen);
+        p += klen;
+        uint32_t deadline = 0, cnt;
+        if (has_ttl) {
+            memcpy(&deadline, p, 4);
+            p += 4;
+        }
+        memcpy(&cnt, p, 4);
+        p += 4;
+        Postings vals;
+        if (delta) {
+            if ((size_t)(end - p) < cnt) {
+                ff.note("record at +%zu: %u values run past the image", at, cnt);
+                return false;
+            }
+            vals.resize(cnt);
+            uint32_t prev = 0;
+            for (uint32_t i = 0; i < cnt; ++i) {
+                uint32_t d;
+                if (!get_varint(p, end, d)) {
+                    ff.note("record at +%zu: truncated value delta", at);
+                    return false;
+                }
+                prev += d;
+                vals[i] = (int)prev;
+            }
+        } else {
+            if ((size_t)(end - p) / sizeof(int) < cnt) {
+                ff.note("record at +%zu: %u values run past the image", at, cnt);
+                return false;
+            }
+            vals.resize(cnt);
+            if (cnt) memcpy(vals.data(), p, cnt * sizeof(int));
+            p += cnt * sizeof(int);
+        }
+        ++ff.records;
+        fsck_keep(b, std::move(key), std::move(vals), deadline, out, moved, ff);
+    }
+    return true;
+}
+
+// Folds sharded keys whose directory and shard records disagree (see shard_problem)
+static void fsck_shards(Bucket &out, FsckFile &ff) {
+    for (const auto &f : check_shards(out)) {
+        ff.note("key %s: %s, folded into one record", fsck_show(f.first).c_str(), f.second);
+    }
+}
+
+// Checks one bucket file into `out` (the salvage); returns whether it needs a rewrite
+static bool fsck_bucket(int b, const string &path, Bucket &out, vector<MovedKey> &moved, FsckFile &ff) {
+    string buf;
+    if (!read_file(path, buf) || buf.empty()) return false;
+    if (buf.size() < 4 || buf[0] != 'B' || buf[1] != 'K') {
+        // legacy text: every line must parse
+        size_t pos = 0, lineno = 0;
+        string line, idx;
+        vector<int> vals;
+        while (pos < buf.size()) {
+            size_t nl = buf.find('\n', pos);
+            if (nl == string::npos) nl = buf.size();
+            line.assign(buf, pos, nl - pos);
+            pos = nl + 1;
+            ++lineno;
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty()) continue;
+            if (!parse_line_fast(line, idx, vals)) {
+                ff.note("line %zu: not a bucket record (corrupt binary header?)", lineno);
+                continue;
+            }
+            ++ff.records;
+            fsck_keep(b, idx, Postings(vals.begin(), vals.end()), 0, out, moved, ff);
+        }
+        return true; // rewritten as binary either way
+    }
+    unsigned char flags = (unsigned char)buf[3];
+    char version = buf[2];
+    if (version != '1' && version != '2' && version != '3') {
+        ff.note("unknown format version '%c'", version);
+        return true;
+    }
+    if (version == '1') flags = 0;
+    if (flags & ~(BK_FLAG_VARINT_KLEN | BK_FLAG_TTL)) {
+        ff.note("unknown header flags 0x%02x", flags);
+        return true;
+    }
+    if ((flags & BK_FLAG_TTL) && !(flags & BK_FLAG_VARINT_KLEN)) {
+        ff.note("TTL layout without varint key lengths");
+        return true;
+    }
+    const char *p = buf.data(), *end = p + buf.size();
+    if (version == '1') {
+        fsck_records(p + 4, end, 0, false, b, out, moved, ff);
+        fsck_shards(out, ff);
+        return !ff.problems.empty();
+    }
+    uint32_t base = 0;
+    if (buf.size() >= 8) memcpy(&base, p + 4, 4);
+    if (base < (version == '3' ? 12u : 8u) || base > buf.size()) {
+        ff.note("base image size %u outside the file (%zu bytes)", base, buf.size());
+        // a truncated plain image still holds its leading records
+        if (version == '2' && buf.size() > 8) fsck_records(p + 8, end, flags, false, b, out, moved, ff);
+        fsck_shards(out, ff);
+        return true;
+    }
+    if (version == '3') {
+        uint32_t raw_bytes;
+        memcpy(&raw_bytes, p + 8, 4);
+        if (raw_bytes > lz_max_raw(base - 12)) {
+            ff.note("compressed image cannot decode to %u bytes", raw_bytes);
+            return true;
+        }
+        string raw(raw_bytes, '\0');
+        if (!lz_decompress(p + 12, base - 12, &raw[0], raw_bytes)) {
+            ff.note("compressed image does not decode to %u bytes", raw_bytes);
+            return true;
+        }
+        fsck_records(raw.data(), raw.data() + raw.size(), flags, true, b, out, moved, ff);
+    } else {
+        fsck_records(p + 8, p + base, flags, false, b, out, moved, ff);
+    }
+    fsck_shards(out, ff);
+    out.varint_klen = flags & BK_FLAG_VARINT_KLEN;
+    size_t applied = replay_journal(p + base, end, out);
+    if (applied < (size_t)(end - p - base)) {
+        ff.note("journal: torn or corrupt tail at +%zu, %zu byte(s) dropped", (size_t)base + applied,
+                (size_t)(end - p - base) - applied);
+    }
+    for (auto it = out.map.begin(); it != out.map.end();) {
+        if (bucket_id(it->first) == b) {
+            ++it;
+            continue;
+        }
+        ff.note("journal key %s: belongs in bucket %d", fsck_show(it->first).c_str(), bucket_id(it->first));
+        auto dl = out.expiry.find(it->first);
+        moved.push_back({it->first, std::move(it->second), dl == out.expiry.end() ? 0 : dl->second});
+        if (dl != out.expiry.end()) out.expiry.erase(dl);
+        it = out.map.erase(it);
+    }
+    return !ff.problems.empty();
+}
+
+// Full key of a leaf slot, following its overflow chain in paged_fp
+static void slot_key(const char *slot, string &key) {
+    size_t l = (unsigned char)slot[0];
+    if (l != SLOT_OVERFLOW) {
+        key.assign(slot + 1, l);
+        return;
+    }
+    uint32_t len;
+    memcpy(&len, slot + 1 + OVERFLOW_PREFIX + 4, 4);
+    static string suffix;
+    paged_read_overflow(slot_overflow(slot), len - OVERFLOW_PREFIX, suffix);
+    key.assign(slot + 1, OVERFLOW_PREFIX);
+    key.append(suffix);
+}
+
+// Streams pages.dat: every page's header and pointers, then the leaf chain in key order
+static bool fsck_pages(FsckFile &ff) {
+    paged_fp = fopen(paged_path().c_str(), "rb");
+    if (!paged_fp) return false;
+    vector<char> pg(PAGE_SIZE);
+    auto read_page = [&pg](uint32_t id) {
+        fseek(paged_fp, (long)id * (long)PAGE_SIZE, SEEK_SET);
+        return fread(pg.data(), 1, PAGE_SIZE, paged_fp) == PAGE_SIZE;
+    };
+    PagedMeta m;
+    if (!read_page(0) || memcmp(pg.data(), "BPT1", 4) != 0) {
+        ff.note("meta page missing or without BPT1 magic");
+        fclose(paged_fp);
+        paged_fp = nullptr;
+        return true;
+    }
+    memcpy(&m.root, &pg[4], 4);
+    memcpy(&m.npages, &pg[8], 4);
+    memcpy(&m.height, &pg[12], 4);
+    memcpy(&m.entries, &pg[16], 8);
+    if (m.root == 0 || m.root >= m.npages) ff.note("meta: root %u outside %u pages", m.root, m.npages);
+    for (uint32_t id = 1; id < m.npages; ++id) {
+        if (!read_page(id)) {
+            ff.note("page %u: past the end of the file", id);
+            break;
+        }
+        uint16_t type = page_type(pg.data()), cnt = page_count(pg.data());
+        uint32_t link = page_link(pg.data());
+        if (link >= m.npages) ff.note("page %u: link %u outside the file", id, link);
+        if (type == PAGE_LEAF) {
+            if (cnt > LEAF_CAP) ff.note("page %u: %u slots exceed leaf capacity", id, cnt);
+            for (uint16_t i = 0; i < min<uint16_t>(cnt, LEAF_CAP); ++i) {
+                const char *slot = leaf_slot(pg.data(), i);
+                size_t l = (unsigned char)slot[0];
+                uint32_t len;
+                memcpy(&len, slot + 1 + OVERFLOW_PREFIX + 4, 4);
+                if (l != SLOT_OVERFLOW && l > PAGED_KEY_MAX) ff.note("page %u slot %u: key length %zu", id, i, l);
+                if (l == SLOT_OVERFLOW && (slot_overflow(slot) >= m.npages || len <= OVERFLOW_PREFIX)) {
+                    ff.note("page %u slot %u: bad overflow reference", id, i);
+                }
+            }
+        } else if (type == PAGE_INNER) {
+            if (cnt > INNER_CAP) ff.note("page %u: %u entries exceed inner capacity", id, cnt);
+            for (uint16_t i = 1; i <= min<uint16_t>(cnt, INNER_CAP); ++i) {
+                if (inner_child(pg.data(), i) >= m.npages) ff.note("page %u: child %u outside the file", id, i);
+            }
+        } else if (type == PAGE_OVERFLOW) {
+            if (cnt > OVERFLOW_DATA) ff.note("page %u: overflow length %u", id, cnt);
+        } else {
+            ff.note("page %u: unknown type %u", id, type);
+        }
+    }
+    if (ff.problems.empty()) {
+        // descend to the leftmost leaf, then check order and entry count along the chain
+        uint32_t id = m.root;
+        for (uint32_t depth = 1; read_page(id) && page_type(pg.data()) == PAGE_INNER && depth < m.height; ++depth) {
+            id = inner_child(pg.data(), 0);
+        }
+        string prev_key, key;
+        int prev_val = 0;
+        uint64_t entries = 0, steps = 0;
+        for (; id && read_page(id) && steps <= m.npages; ++steps) {
+            if (page_type(pg.data()) != PAGE_LEAF) {
+                ff.note("leaf chain reaches non-leaf page %u", id);
+                break;
+            }
+            vector<char> leaf = pg; // slot_key reads overflow pages through the same file
+            for (uint16_t i = 0; i < page_count(leaf.data()); ++i, ++entries) {
+                const char *slot = leaf_slot(leaf.data(), i);
+                slot_key(slot, key);
+                int val = slot_value(slot);
+                if (entries && (key < prev_key || (key == prev_key && val <= prev_val))) {
+                    ff.note("page %u slot %u: out of order", id, i);
+                }
+                prev_key.swap(key);
+                prev_val = val;
+            }
+            ff.records += page_count(leaf.data());
+            id = page_link(leaf.data());
+        }
+        if (steps > m.npages) ff.note("leaf chain loops");
+        if (entries != m.entries) {
+            ff.note("meta counts %llu entries, leaves hold %llu", (unsigned long long)m.entries, (unsigned long long)entries);
+        }
+    }
+    fclose(paged_fp);
+    paged_fp = nullptr;
+    return !ff.problems.empty();
+}
+
+// Exit status follows fsck(8): 0 clean, 1 errors corrected, 4 errors left uncorrected
+static int run_fsck(bool repair) {
+    vector<MovedKey> moved;
+    vector<bool> rewrite(slot_count());
+    size_t damaged = 0;
+    for (int b = 0; b < slot_count(); ++b) {
+        string path = locate_bucket(b);
+        FsckFile ff;
+        ff.name = path;
+        Bucket bk;
+        rewrite[b] = fsck_bucket(b, path, bk, moved, ff);
+        damaged += ff.report();
+        if (repair && rewrite[b]) {
+            flush_bucket_binary_file(bucket_path(b), bk);
+            if (path != bucket_path(b)) filesystem::remove(path);
+        }
+    }
+    if (repair && !moved.empty()) {
+        // misplaced keys join their own bucket, one target bucket in memory at a time
+        sort(moved.begin(), moved.end(), [](const MovedKey &x, const MovedKey &y) { return bucket_id(x.key) < bucket_id(y.key); });
+        for (size_t i = 0; i < moved.size();) {
+            int b = bucket_id(moved[i].key);
+            Bucket bk;
+            read_bucket(b, bk);
+            for (; i < moved.size() && bucket_id(moved[i].key) == b; ++i) {
+                Postings &vals = bk.map[moved[i].key];
+                Postings merged;
+                set_union(vals.begin(), vals.end(), moved[i].vals.begin(), moved[i].vals.end(), back_inserter(merged));
+                vals.swap(merged);
+                if (moved[i].deadline) bk.expiry[logical_key(moved[i].key)] = moved[i].deadline;
+            }
+            flush_bucket_binary_file(bucket_path(b), bk);
+        }
+    }
+    FsckFile pages;
+    pages.name = paged_path();
+    bool pages_bad = fsck_pages(pages);
+    pages.report();
+    printf("fsck: %d buckets, %zu damaged%s, %zu misplaced key(s)%s\n", slot_count(), damaged,
+           repair && damaged ? " (repaired)" : "", moved.size(), pages_bad ? ", pages.dat damaged" : "");
+    if (pages_bad || (damaged && !repair)) return 4;
+    return damaged ? 1 : 0;
+}
+
+static const char *USAGE =
+    "usage: %s [options] < commands\n"
+    "  --compress          write LZ-compressed bucket images\n"
+    "  --paged             use the paged B+ tree engine\n"
+    "  --paged-import      convert the bucket files into the paged engine and exit\n"
+    "  --pool-pages N      paged buffer pool size in 4 KiB pages (default 256)\n"
+    "  --stats             print engine counters to stderr at exit\n"
+    "  --data-dir DIR      bucket directory; repeat to spread buckets (default data)\n"
+    "  --rebalance         migrate all misplaced buckets in this run\n"
+    "  --router N          fan commands out to N worker processes by bucket\n"
+    "  --replicate-to SOCK stream mutations to a standby listening on SOCK\n"
+    "  --standby SOCK      apply a primary's mutation stream to this data directory\n"
+    "  --backup DIR        add an incremental backup point to DIR after the run\n"
+    "  --restore DIR       rebuild the data directories from DIR and exit\n"
+    "  --point K           restore backup point K (default: the latest)\n"
+    "  --at UNIXTIME       restore the last point taken at or before UNIXTIME\n"
+    "  --latency           print per-command latency percentiles at exit and on SIGUSR1\n"
+    "  --metrics FILE      keep Prometheus-format engine metrics in FILE\n"
+    "  --metrics-interval S  seconds between metrics refreshes (default 1)\n"
+    "  --trace FILE        write load/flush/evict/command spans as Chrome trace JSON\n"
+    "  --fsck              check bucket files and pages.dat, then exit\n"
+    "  --repair            with --fsck: rebuild damaged buckets from their valid records\n"
+    "  --alloc-warmup N    report heap allocations made by commands after the first N\n"
+    "  --prewarm           prefetch the buckets earlier runs used most (history in data/heat)\n"
+    "  --reshard N         move keys to an N-bucket layout, one bucket every 256 commands\n"
+    "  --encode FMT        response encoding: text (default), delta (varint deltas) or lz\n"
+    "                      (LZ-framed text); filestore-decode turns either back into text\n"
+    "  --lookahead N       collapse superseded mutations and repeated finds within windows\n"
+    "                      of N commands (output is unchanged)\n";
+
+static void parse_options(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--compress") {
+            opt.compress = true;
+        } else if (a == "--paged") {
+            opt.paged = true;
+        } else if (a == "--paged-import") {
+            opt.paged_import = true;
+        } else if (a == "--pool-pages" && i + 1 < argc) {
+            opt.pool_pages = strtoul(argv[++i], nullptr, 10);
+        } else if (a == "--stats") {
+            opt.stats = true;
+        } else if (a == "--data-dir" && i + 1 < argc) {
+            opt.data_dirs.push_back(argv[++i]);
+        } else if (a == "--rebalance") {
+            opt.rebalance = true;
+        } else if (a == "--router" && i + 1 < argc) {
+            opt.router = atoi(argv[++i]);
+        } else if (a == "--replicate-to" && i + 1 < argc) {
+            opt.replicate_to = argv[++i];
+        } else if (a == "--standby" && i + 1 < argc) {
+            opt.standby = argv[++i];
+        } else if (a == "--backup" && i + 1 < argc) {
+            opt.backup = argv[++i];
+        } else if (a == "--restore" && i + 1 < argc) {
+            opt.restore = argv[++i];
+        } else if (a == "--point" && i + 1 < argc) {
+            opt.restore_point = atol(argv[++i]);
+        } else if (a == "--at" && i + 1 < argc) {
+            opt.restore_at = atoll(argv[++i]);
+        } else if (a == "--latency") {
+            opt.latency = true;
+        } else if (a == "--metrics" && i + 1 < argc) {
+            opt.metrics = argv[++i];
+        } else if (a == "--metrics-interval" && i + 1 < argc) {
+            opt.metrics_interval = atof(argv[++i]);
+        } else if (a == "--trace" && i + 1 < argc) {
+            opt.trace = argv[++i];
+        } else if (a == "--fsck") {
+            opt.fsck = true;
+        } else if (a == "--repair") {
+            opt.repair = true;
+        } else if (a == "--alloc-warmup" && i + 1 < argc) {
+            opt.alloc_warmup = atol(argv[++i]);
+        } else if (a == "--prewarm") {
+            opt.prewarm = true;
+        } else if (a == "--reshard" && i + 1 < argc) {
+            opt.reshard = atoi(argv[++i]);
+        } else if (a == "--lookahead" && i + 1 < argc) {
+            opt.lookahead = atoi(argv[++i]);
+        } else if (a == "--encode" && i + 1 < argc) {
+            string e = argv[++i];
+            if (e == "text") {
+                opt.encode = ENC_TEXT;
+            } else if (e == "delta") {
+                opt.encode = ENC_DELTA;
+            } else if (e == "lz") {
+                opt.encode = ENC_LZ;
+            } else {
+                fprintf(stderr, "--encode takes text, delta or lz\n");
+                exit(2);
+            }
+        } else {
+            fprintf(stderr, USAGE, argv[0]);
+            exit(2);
+        }
+    }
+    build_ring();
+    if (opt.router && !opt.replicate_to.empty()) {
+        fprintf(stderr, "--replicate-to is not supported with --router\n");
+        exit(2);
+    }
+    if (opt.lookahead < 0 || opt.lookahead > (1 << 20)) {
+        fprintf(stderr, "--lookahead takes 0..%d commands\n", 1 << 20);
+        exit(2);
+    }
+    if (opt.reshard && (opt.reshard < 1 || opt.reshard > MAX_BUCKETS)) {
+        fprintf(stderr, "--reshard takes 1..%d buckets\n", MAX_BUCKETS);
+        exit(2);
+    }
+    if (opt.reshard && (opt.router || opt.paged)) {
+        fprintf(stderr, "--reshard migrates the bucket engine in-process; it cannot be combined with --router or --paged\n");
+        exit(2);
+    }
+    if (opt.rebalance && opt.router) {
+        fprintf(stderr, "--rebalance migrates buckets in-process; it cannot be combined with --router\n");
+        exit(2);
+    }
+    if (opt.router && (opt.paged || opt.paged_import)) {
+        fprintf(stderr, "--router shards the bucket engine; it cannot be combined with --paged\n");
+        exit(2);
+    }
+}
+
+#ifdef FILESTORE_INSPECT
+// filestore-inspect (built from this file with -DFILESTORE_INSPECT): read-only report on
+// the bucket files. Buckets are read one at a time through the normal loader, so memory
+// peaks at a single bucket, and journals are replayed so counts match what a run sees.
+struct InspectBucket {
+    const char *format = "missing";
+    unsigned flags = 0;
+    uint64_t bytes = 0, journal = 0;
+    size_t keys = 0, empty = 0, values = 0, ttl = 0, misplaced = 0;
+};
+
+static const char *inspect_format(const string &path, InspectBucket &ib) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) return "missing";
+    unsigned char h[4];
+    size_t got = fread(h, 1, 4, f);
+    fseek(f, 0, SEEK_END);
+    ib.bytes = (uint64_t)ftell(f);
+    fclose(f);
+    if (!ib.bytes) return "empty";
+    if (got < 4 || h[0] != 'B' || h[1] != 'K') return "text";
+    ib.flags = h[2] == '1' ? 0 : h[3];
+    if (h[2] == '1') return "BK1";
+    if (h[2] == '2') return "BK2";
+    if (h[2] == '3') return "BK3";
+    return "unknown";
+}
+
+// Keys as typed: the namespace separator is shown as ':'
+static string display_key(string key) {
+    replace(key.begin(), key.end(), NS_SEP, ':');
+    replace(key.begin(), key.end(), SHARD_SEP, '#');
+    return key;
+}
+
+static int run_inspect(int argc, char **argv) {
+    size_t top = 10;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--data-dir" && i + 1 < argc) {
+            opt.data_dirs.push_back(argv[++i]);
+        } else if (a == "--top" && i + 1 < argc) {
+            top = strtoul(argv[++i], nullptr, 10);
+        } else {
+            fprintf(stderr, "usage: %s [--data-dir DIR]... [--top N]\n", argv[0]);
+            return 2;
+        }
+    }
+    build_ring();
+    read_layout(layout_path(), layout);
+    vector<InspectBucket> stats(slot_count());
+    vector<size_t> dist(34); // keys by value count: 0, 1, 2-3, 4-7, ...
+    priority_queue<pair<size_t, string>, vector<pair<size_t, string>>, greater<>> largest;
+    printf("%-6s %-7s %-11s %10s %9s %9s %7s %10s %6s %9s\n", "bucket", "format", "flags", "bytes", "journal",
+           "keys", "empty", "values", "ttl", "misplaced");
+    for (int b = 0; b < slot_count(); ++b) {
+        InspectBucket &ib = stats[b];
+        string path = locate_bucket(b);
+        ib.format = inspect_format(path, ib);
+        Bucket bk;
+        if (ib.bytes) read_bucket(b, bk);
+        ib.journal = bk.journal_bytes;
+        ib.ttl = bk.expiry.size();
+        auto count_key = [&](const string &key, size_t n) {
+            ++ib.keys;
+            ib.empty += n == 0;
+            ib.values += n;
+            ib.misplaced += bucket_id(key) != b;
+            ++dist[n ? 64 - __builtin_clzll(n) : 0];
+            if (top && (largest.size() < top || n > largest.top().first)) {
+                largest.emplace(n, key);
+                if (largest.size() > top) largest.pop();
+            }
+        };
+        map<string, size_t> sharded; // logical key -> values over its shards; directories hold bounds
+        for (const auto &kv : bk.map) {
+            size_t len = logical_len(kv.first);
+            if (len == kv.first.size()) {
+                count_key(kv.first, kv.second.size());
+            } else {
+                size_t &n = sharded[kv.first.substr(0, len)];
+                if (!is_shard_dir(kv.first)) n += kv.second.size();
+            }
+        }
+        for (const auto &ks : sharded) count_key(ks.first, ks.second);
+        string flags;
+        if (ib.flags & BK_FLAG_VARINT_KLEN) flags += "varint";
+        if (ib.flags & BK_FLAG_TTL) flags += flags.empty() ? "ttl" : ",ttl";
+        printf("%-6d %-7s %-11s %10llu %9llu %9zu %7zu %10zu %6zu %9zu\n", b, ib.format, flags.empty() ? "-" : flags.c_str(),
+               (unsigned long long)ib.bytes, (unsigned long long)ib.journal, ib.keys, ib.empty, ib.values, ib.ttl,
+               ib.misplaced);
+    }
+    size_t keys = 0, values = 0, empty = 0, min_keys = SIZE_MAX, max_keys = 0;
+    uint64_t bytes = 0;
+    for (const InspectBucket &ib : stats) {
+        keys += ib.keys;
+        values += ib.values;
+        empty += ib.empty;
+        bytes += ib.bytes;
+        min_keys = min(min_keys, ib.keys);
+        max_keys = max(max_keys, ib.keys);
+    }
+    printf("total: %zu keys (%zu empty), %zu values, %llu bytes\n", keys, empty, values, (unsigned long long)bytes);
+
+    double mean = (double)keys / slot_count(), var = 0;
+    for (const InspectBucket &ib : stats) var += ((double)ib.keys - mean) * ((double)ib.keys - mean);
+    double cv = mean > 0 ? sqrt(var / slot_count()) / mean : 0;
+    printf("hash skew: keys/bucket mean %.1f, min %zu, max %zu, max/mean %.2f, cv %.3f\n", mean, min_keys, max_keys,
+           mean > 0 ? (double)max_keys / mean : 0.0, cv);
+
+    printf("value-count distribution:\n");
+    for (size_t c = 0; c < dist.size(); ++c) {
+        if (!dist[c]) continue;
+        string label = to_string(c < 2 ? c : (size_t)1 << (c - 1));
+        if (c >= 2) label += "-" + to_string(((size_t)1 << c) - 1);
+        printf("  %-17s %zu\n", label.c_str(), dist[c]);
+    }
+    vector<pair<size_t, string>> ranked;
+    for (; !largest.empty(); largest.pop()) ranked.push_back(largest.top());
+    printf("largest keys:\n");
+    for (auto it = ranked.rbegin(); it != ranked.rend(); ++it) printf("  %10zu  %s\n", it->first, display_key(it->second).c_str());
+
+    FILE *pf = fopen(paged_path().c_str(), "rb");
+    char hdr[24];
+    if (pf && fread(hdr, 1, sizeof(hdr), pf) == sizeof(hdr) && memcmp(hdr, "BPT1", 4) == 0) {
+        PagedMeta m;
+        memcpy(&m.npages, hdr + 8, 4);
+        memcpy(&m.height, hdr + 12, 4);
+        memcpy(&m.entries, hdr + 16, 8);
+        printf("pages.dat: %u pages, height %u, %llu entries\n", m.npages, m.height, (unsigned long long)m.entries);
+    }
+    if (pf) fclose(pf);
+    return 0;
+}
+#endif
+
+#ifdef FILESTORE_DECODE
+// filestore-decode (built from this file with -DFILESTORE_DECODE): turns a response stream
+// written with --encode delta or lz back into the default decimal text, streaming from
+// stdin to stdout; input without the "FSE" header is copied through unchanged.
+static int decode_fail(const char *what) {
+    out.flush();
+    fprintf(stderr, "filestore-decode: %s\n", what);
+    return 1;
+}
+
+static bool read_exact(char *p, size_t n) {
+    return fread(p, 1, n, stdin) == n;
+}
+
+static int decode_delta() {
+    static vector<int> vals;
+    uint32_t n;
+    int c;
+    while ((c = getchar_unlocked()) != EOF) {
+        n = 0;
+        for (int shift = 0;; shift += 7) {
+            n |= (uint32_t)(c & 0x7F) << shift;
+            if (!(c & 0x80)) break;
+            if (shift == 28 || (c = getchar_unlocked()) == EOF) return decode_fail("truncated response");
+        }
+        vals.resize(n);
+        uint32_t prev = 0;
+        for (uint32_t i = 0; i < n; ++i) {
+            uint32_t d = 0;
+            for (int shift = 0;; shift += 7) {
+                if (shift > 28 || (c = getchar_unlocked()) == EOF) return decode_fail("truncated response");
+                d |= (uint32_t)(c & 0x7F) << shift;
+                if (!(c & 0x80)) break;
+            }
+            prev += d;
+            vals[i] = (int)prev;
+        }
+        print_values(vals.data(), vals.size());
+    }
+    return 0;
+}
+
+static int decode_lz() {
+    string packed, raw;
+    uint32_t hdr[2];
+    while (read_exact(reinterpret_cast<char*>(hdr), sizeof(hdr))) {
+        packed.resize(hdr[1]);
+        raw.resize(hdr[0]);
+        if (!read_exact(&packed[0], hdr[1]) || !lz_decompress(packed.data(), packed.size(), &raw[0], raw.size())) {
+            return decode_fail("corrupt frame");
+        }
+        out.put(raw.data(), raw.size());
+    }
+    return feof(stdin) && !ferror(stdin) ? 0 : decode_fail("read error");
+}
+
+static int run_decode(int argc, char **argv) {
+    if (argc > 1) {
+        fprintf(stderr, "usage: %s < encoded-responses > text\n", argv[0]);
+        return 2;
+    }
+    char hdr[4];
+    size_t got = fread(hdr, 1, 4, stdin);
+    int rc = 0;
+    if (got == 4 && memcmp(hdr, "FSED", 4) == 0) {
+        rc = decode_delta();
+    } else if (got == 4 && memcmp(hdr, "FSEZ", 4) == 0) {
+        rc = decode_lz();
+    } else {
+        out.put(hdr, got);
+        char chunk[1 << 16];
+        while ((got = fread(chunk, 1, sizeof(chunk), stdin)) > 0) out.put(chunk, got);
+    }
+    out.flush();
+    return rc;
+}
+#endif
+
+int main(int argc, char **argv) {
+#ifdef FILESTORE_INSPECT
+    return run_inspect(argc, argv);
+#endif
+#ifdef FILESTORE_DECODE
+    return run_decode(argc, argv);
+#endif
+    parse_options(argc, argv);
+    init_cpu_dispatch();
+    metrics_started = metrics_last = trace_epoch = lat_now();
+    trace_on = !opt.trace.empty();
+    if (opt.latency) {
+        lat_hist = new LatencyHist[LAT_KINDS]();
+        signal(SIGUSR1, [](int) { lat_dump_requested = 1; });
+    }
+
+    for (const string &dir : opt.data_dirs) filesystem::create_directories(dir);
+    if (read_layout(layout_path(), layout) && layout.to && layout.migrated == layout.from) {
+        layout = Layout{layout.to, 0, 0}; // a finished reshard: the new layout is the only one
+        write_layout();
+    }
+    if (!opt.restore.empty()) {
+        run_restore(opt.restore, opt.restore_point, opt.restore_at);
+        return 0;
+    }
+    if (opt.fsck) return run_fsck(opt.repair);
+    if (opt.paged_import) {
+        paged_import_buckets(opt.pool_pages);
+        return 0;
+    }
+    if (opt.standby.empty()) write_stream_header();
+    if (opt.router > 0) {
+        spawn_workers(opt.router);
+        if (!opt.worker) {
+            long n;
+            int count;
+            n = in.integer(count) ? count : 0;
+            run_router(n);
+            out.flush();
+            if (!opt.backup.empty()) run_backup(opt.backup);
+            return 0;
+        }
+    }
+    if (opt.paged) paged_open(opt.pool_pages);
+    else if (opt.rebalance) rebalance_buckets();
+    if (!opt.standby.empty()) {
+        run_standby(opt.standby);
+        if (opt.paged) paged_close();
+        if (trace_on) write_trace(opt.trace);
+        return 0;
+    }
+    if (!opt.replicate_to.empty()) replicate_connect(opt.replicate_to);
+    if (opt.reshard) start_reshard(opt.reshard);
+    bool resharding = layout.to && !opt.worker && !opt.paged;
+    bool prewarming = opt.prewarm && !opt.paged;
+    if (prewarming) start_prewarm();
+
+    // Workers get no count line; they run until the router closes their pipe
+    long n = LONG_MAX;
+    int count;
+    if (!opt.worker) n = in.integer(count) ? count : 0;
+    if (opt.lookahead > 1) {
+        window.resize(opt.lookahead);
+        window_found.resize(opt.lookahead);
+    }
+    string cmd;
+    for (long i = 0; i < n; ++i) {
+        if (i == opt.alloc_warmup) alloc_counting = true;
+        if (resharding && i % RESHARD_EVERY == RESHARD_EVERY - 1 && layout.migrated < layout.from) reshard_step();
+        Command &c = window[window_len];
+        if (!in.token(cmd) || !in.token(c.key)) break;
+        ++pstats.ops;
+        ++tenants[cur_tenant].ops;
+        if (lat_dump_requested) {
+            lat_dump_requested = 0;
+            print_latency();
+        }
+        if (i % METRICS_CHECK_EVERY == 0) metrics_tick(false);
+        if (cmd == "use") {
+            use_namespace(c.key);
+            continue;
+        }
+        parse_command(c, cmd);
+        // run before a read that may block, so everything asked so far gets answered
+        if (++window_len == window.size() || in.drained()) run_window();
+    }
+    run_window();
+    if (opt.alloc_warmup >= 0) {
+        alloc_counting = false;
+        fprintf(stderr, "allocs: %llu after %ld warm-up commands\n", (unsigned long long)alloc_count.load(),
+                opt.alloc_warmup);
+    }
+    if (prewarming) finish_prewarm();
+    // Flush all cached buckets
+    flush_all_buckets();
+    if (opt.stats && !opt.paged) print_posting_stats();
+    if (opt.stats && opt.lookahead > 1) {
+        fprintf(stderr, "lookahead: windows=%llu collapsed=%llu coalesced=%llu\n", (unsigned long long)wstats.windows,
+                (unsigned long long)wstats.collapsed, (unsigned long long)wstats.coalesced);
+    }
+    replicate_flush();
+    print_latency();
+    metrics_tick(true);
+    if (trace_on) write_trace(opt.trace);
+    if (opt.paged) {
+        if (opt.stats) {
+            fprintf(stderr, "paged: entries=%llu pages=%u height=%u fetches/op=%.2f reads/op=%.3f writes=%llu\n",
+                    (unsigned long long)pmeta.entries, pmeta.npages, pmeta.height,
+                    pstats.ops ? (double)pstats.fetches / pstats.ops : 0.0,
+                    pstats.ops ? (double)pstats.reads / pstats.ops : 0.0, (unsigned long long)pstats.writes);
+            for (const Tenant &t : tenants) {
+                fprintf(stderr, "paged: namespace=%s ops=%llu frames=%zu\n", t.name.empty() ? "-" : t.name.c_str(),
+                        (unsigned long long)t.ops, t.frames);
+            }
+        }
+        paged_close();
     }
+    out.flush();
+    if (!opt.backup.empty() && !opt.worker) run_backup(opt.backup);
     return 0;
 }